@@ -6,148 +6,3021 @@
 #include <linux/uaccess.h> /* copy_(to|from)_user */
 #include <linux/cdev.h> /*Needed for cdev */
 #include <linux/device.h> /* Needed for device_create */
+#include <linux/mutex.h> /* Needed for the list lock */
+#include <linux/wait.h> /* Needed for the wait queues */
+#include <linux/poll.h> /* Needed for poll */
+#include <linux/mm.h> /* Needed for mmap */
+#include <linux/vmalloc.h> /* Needed for vmalloc_user */
+#include <linux/rcupdate.h> /* Needed to replace the ring on resize */
+#include <linux/log2.h> /* Needed for roundup_pow_of_two */
+#include <linux/percpu.h> /* Needed for the statistics */
+#include <linux/signal.h> /* Needed for SIGIO */
+#include <linux/spinlock.h> /* Needed for the shard locks */
+#include <linux/cpumask.h> /* Needed to walk the shards */
+#include <linux/topology.h> /* Needed for cpu_to_node */
+#include <linux/list.h> /* Needed for the segments */
+#include <linux/gfp.h> /* Needed for __get_free_page */
+#include <linux/ktime.h> /* Needed for the timestamps */
+#include <linux/debugfs.h> /* Needed for the latency histograms */
+#include <linux/seq_file.h> /* Needed for the latency histograms */
+#include <linux/uio.h> /* Needed for read_iter and write_iter */
+#include <linux/splice.h> /* Needed for splice */
+#include <linux/eventfd.h> /* Needed for the arrival notifications */
 
 #include <linux/string.h>
 
 #include "flifo.h"
+#include "flifo_core.h"
 
 #define MAJOR_NUM   97
 #define DEVICE_NAME "flifo"
 
-static int values[NB_VALUES];
-static size_t next_in;
-static size_t nb_values;
-static int mode;
-static int value_read = 0;
+// The indices are free-running and masked, the capacity is rounded up to a
+// power of 2
+#define MAX_CAPACITY (1U << 26)
+
+// The values follow the header page of the ring
+#define RING_VALUES(ring) ((int *)((char *)(ring) + PAGE_SIZE))
+
+// LIFO reads reverse the values through a bounce buffer of this size
+#define LIFO_CHUNK  64
+
+// Largest value in bytes, a LIFO read must fit at least one in the bounce
+// buffer
+#define MAX_ELEM_SIZE (LIFO_CHUNK * sizeof(int))
+
+// Largest ring in bytes, whatever the size of its values
+#define MAX_RING_SIZE (MAX_CAPACITY * sizeof(int))
+
+// Each minor is an independent list
+#define MAX_DEVICES 256
+
+// Drained segments kept for the next writes of an unbounded list
+#define FREE_SEGMENTS 4
+
+// Bucket b of the latency histograms counts the latencies of b significant
+// bits, the last one everything above
+#define LATENCY_BUCKETS 40
+
+static unsigned int capacity = NB_VALUES;
+module_param(capacity, uint, 0444);
+MODULE_PARM_DESC(capacity, "Initial number of values in the list");
+
+static unsigned int elem_size = sizeof(int);
+module_param(elem_size, uint, 0444);
+MODULE_PARM_DESC(elem_size, "Initial size of the values in bytes");
+
+static unsigned int nb_devices = 1;
+module_param(nb_devices, uint, 0444);
+MODULE_PARM_DESC(nb_devices, "Number of lists, exposed as /dev/flifo0..N-1");
+
+static bool timestamps = true;
+module_param(timestamps, bool, 0444);
+MODULE_PARM_DESC(timestamps, "Stamp the values for the TTL and the latencies");
+
+/**
+ * struct flifo_pcpu_stats - Hot path counters, one copy per CPU
+ * @enqueues:	Values written.
+ * @dequeues:	Values read.
+ * @full:	Writes rejected because the list was full.
+ * @empty:	Reads rejected because the list was empty.
+ * @expired:	Values dropped because they were older than the TTL.
+ * @latency:	Histogram of the time the values spent in the list, in ns.
+ */
+struct flifo_pcpu_stats {
+	u64 enqueues;
+	u64 dequeues;
+	u64 full;
+	u64 empty;
+	u64 expired;
+	u64 latency[LATENCY_BUCKETS];
+};
+
+/**
+ * struct flifo_shard - Sub-list of a CPU in SYNC_SHARDED
+ * @lock:	Taken by the tasks of the CPU and by the ones stealing from it.
+ * @head:	Free-running index of the next value to write.
+ * @tail:	Free-running index of the oldest value.
+ * @values:	Ring of flifo_queue.shard_capacity values, allocated on the
+ *		node of the CPU.
+ */
+struct flifo_shard {
+	spinlock_t lock;
+	u32 head;
+	u32 tail;
+	int *values;
+};
+
+/**
+ * struct flifo_segment - Page of values of an unbounded list
+ * @node:	Entry in flifo_queue.segments or flifo_queue.free_segments.
+ * @head:	Index of the next value to write.
+ * @tail:	Index of the oldest value.
+ * @values:	Values, up to the end of the page.
+ */
+struct flifo_segment {
+	struct list_head node;
+	u32 head;
+	u32 tail;
+	int values[];
+};
+
+#define SEGMENT_VALUES \
+	((PAGE_SIZE - sizeof(struct flifo_segment)) / sizeof(int))
+
+/**
+ * struct flifo_queue - State of the list
+ * @ring:	Header page shared with user space. ring->head is the
+ *		free-running index of the next value to write, only moved by
+ *		producers (and by LIFO readers, with both locks held).
+ *		ring->tail is the free-running index of the oldest value, only
+ *		moved by consumers. Replaced on resize, the lockless
+ *		accesses go through RCU.
+ * @values:	Ring of values, in the pages following the header.
+ * @stamps:	Time at which each value of the ring was written, in ns, or
+ *		NULL without the timestamps module parameter. Not kept in the
+ *		priority modes, where the heap moves the values around.
+ * @ttl_us:	Age in us after which the readers drop a value, 0 to keep
+ *		them.
+ * @unstamped:	Set once the ring is mapped, since the producers in user
+ *		space don't stamp their values. Cleared when the list is
+ *		reset or its values restamped.
+ * @capacity:	Number of values in the ring, a power of 2. In SYNC_SHARDED,
+ *		the number of values in all the shards. In an unbounded list,
+ *		the number of values that fit without going over
+ *		@memory_limit.
+ * @elem_size:	Size of a value in bytes. The priority modes, the shards,
+ *		the segments and the mapping only hold ints.
+ * @mode:	Order in which the values are read (MODE_*).
+ * @overwrite:	Writers drop the oldest values instead of waiting for space.
+ * @dropped:	Number of values dropped by the writers in @overwrite, or
+ *		lost by the readers of the shards that failed to copy them
+ *		and found no room to put them back.
+ * @low_mark:	Depth at or under which a throttled list is released.
+ * @high_mark:	Depth at or above which the list is throttled, 0 to disable
+ *		the watermarks.
+ * @throttled:	Set between the crossing of @high_mark and of @low_mark.
+ * @fasync:	Files to signal with SIGIO on watermark crossings, and when
+ *		values arrive in an empty list.
+ * @eventfd:	Signalled when values arrive in an empty list, or NULL.
+ *		Replaced with both locks held, the writers access it under
+ *		RCU.
+ * @sync:	SYNC_MPMC to serialise producers and consumers with the locks,
+ *		SYNC_SPSC to skip them when there is a single producer and a
+ *		single consumer, SYNC_SHARDED to spread the values over
+ *		@shards.
+ * @shards:	One sub-list per CPU in SYNC_SHARDED, NULL otherwise.
+ *		Replaced with both locks held, the readers and writers
+ *		access it under RCU and with the lock of the shard held.
+ * @shard_capacity: Number of values in each shard, a power of 2.
+ * @unbounded:	The values are stored in @segments instead of the ring.
+ * @segments:	Pages of values, oldest first, with both locks held.
+ * @free_segments: Up to FREE_SEGMENTS drained pages kept for reuse.
+ * @nb_segments: Number of pages in @segments.
+ * @nb_free_segments: Number of pages in @free_segments.
+ * @nb_seg_values: Number of values in @segments.
+ * @memory_limit: Maximum number of bytes of @segments and @free_segments.
+ * @readers:	Files opened for reading, with both locks held. Their cursors
+ *		are only used in MODE_BROADCAST.
+ * @prod_lock:	Serialises the producers in SYNC_MPMC.
+ * @cons_lock:	Serialises the consumers in SYNC_MPMC.
+ * @read_wq:	Readers waiting for values.
+ * @write_wq:	Writers waiting for free space.
+ * @nb_maps:	Number of user space mappings of the ring.
+ * @nb_lockless: Readers and writers working on the ring without the locks
+ *		in SYNC_SPSC, the list can't leave SYNC_SPSC while there
+ *		are some.
+ * @stats:	Per-CPU counters, summed when read.
+ * @high_water:	Highest number of values seen in the list.
+ * @mode_switches: Number of actual mode changes, with both locks held.
+ *
+ * Producers and consumers only share @head and @tail, which are published
+ * with release stores and read with acquire loads. A producer therefore
+ * never waits for a consumer and vice versa. In LIFO mode the readers take
+ * values from the head, so they need both locks and SYNC_SPSC is refused.
+ *
+ * A producer or a consumer in user space can work directly on the mapped
+ * ring with the same protocol, and only enters the kernel (FLIFO_CMD_KICK)
+ * when the header flags say that the other side sleeps in the driver.
+ *
+ * An unbounded list also leaves the ring empty. Its values are appended to
+ * the last page of @segments, a new one being taken when it is full, and
+ * read from the first one, which is released once drained. Both locks are
+ * taken by its readers and writers.
+ *
+ * In MODE_BROADCAST every reader has its own cursor in the ring and reads
+ * all the values, with both locks held. ring->tail then follows the
+ * slowest reader with the SLOW_BLOCK policy, so the writers wait for it
+ * like for a single consumer, and is kept at ring->head when there is no
+ * such reader. The readers with the SLOW_DROP policy skip the values
+ * overwritten before they could read them.
+ *
+ * In SYNC_SHARDED the ring is left empty. Producers write to the shard of
+ * their CPU and consumers read from it, only stealing from the other
+ * shards when it is empty (or, for the producers, full). Each shard is
+ * FIFO, but there is no order between the shards: two values written in
+ * sequence by a task that migrated in between may be read in any order.
+ */
+struct flifo_queue {
+	struct flifo_ring *ring;
+	int *values;
+	u64 *stamps;
+	unsigned long ttl_us;
+	bool unstamped;
+	u32 capacity;
+	u32 elem_size;
+	int mode;
+	bool overwrite;
+	u64 dropped;
+	u32 low_mark;
+	u32 high_mark;
+	int throttled;
+	struct fasync_struct *fasync;
+	struct eventfd_ctx __rcu *eventfd;
+	int sync;
+	struct flifo_shard __percpu *shards;
+	u32 shard_capacity;
+	bool unbounded;
+	struct list_head segments;
+	struct list_head free_segments;
+	unsigned long nb_segments;
+	unsigned int nb_free_segments;
+	u32 nb_seg_values;
+	unsigned long memory_limit;
+	struct list_head readers;
+
+	struct mutex prod_lock;
+	struct mutex cons_lock;
+	wait_queue_head_t read_wq;
+	wait_queue_head_t write_wq;
+	atomic_t nb_maps;
+	atomic_t nb_lockless;
+
+	struct flifo_pcpu_stats __percpu *stats;
+	u32 high_water;
+	unsigned long mode_switches;
+};
+
+/**
+ * struct flifo_file - State of an open file of a list
+ * @q:		The list of the minor.
+ * @node:	Entry in flifo_queue.readers if the file is open for reading.
+ * @cursor:	Free-running index of the next value to read in
+ *		MODE_BROADCAST.
+ * @policy:	What happens when the file reads slower than the writers,
+ *		SLOW_BLOCK or SLOW_DROP.
+ * @lag:	Number of values skipped with SLOW_DROP.
+ */
+struct flifo_file {
+	struct flifo_queue *q;
+	struct list_head node;
+	u32 cursor;
+	int policy;
+	u64 lag;
+};
+
+static struct flifo_queue *queues;
 
 // New way to register a char device
 static dev_t dev_num;
 static struct cdev flifo_cdev;
 static struct class *my_class;
 
+static struct flifo_queue *flifo_queue_of(struct file *filp)
+{
+	return ((struct flifo_file *)filp->private_data)->q;
+}
+
+/**
+ * @brief Address of the value at a free-running index of the ring.
+ */
+static void *flifo_slot(struct flifo_queue *q, u32 index)
+{
+	return ring_slot(q->values, q->elem_size, q->capacity, index);
+}
+
+/**
+ * @brief Number of values of esz bytes in count bytes, without a division
+ *        for the ints.
+ */
+static size_t flifo_nb_values(u32 esz, size_t count)
+{
+	return esz == sizeof(int) ? count / sizeof(int) : count / esz;
+}
+
+/**
+ * @brief Whether count bytes hold whole values of esz bytes.
+ */
+static bool flifo_whole_values(u32 esz, size_t count)
+{
+	return count >= esz && flifo_nb_values(esz, count) * esz == count;
+}
+
+/**
+ * @brief Copy n bytes to an iterator, all or nothing, like copy_to_user.
+ *        A partial copy is reverted so the iterator only ever moves by
+ *        whole values.
+ *
+ * @return 0 on success, -EFAULT otherwise.
+ */
+static int flifo_copy_to_iter(const void *from, size_t n,
+			      struct iov_iter *to)
+{
+	size_t copied = copy_to_iter(from, n, to);
+
+	if (copied != n) {
+		iov_iter_revert(to, copied);
+		return -EFAULT;
+	}
+	return 0;
+}
+
+/**
+ * @brief Copy n bytes from an iterator, all or nothing, see
+ *        flifo_copy_to_iter().
+ *
+ * @return 0 on success, -EFAULT otherwise.
+ */
+static int flifo_copy_from_iter(void *to, size_t n, struct iov_iter *from)
+{
+	size_t copied = copy_from_iter(to, n, from);
+
+	if (copied != n) {
+		iov_iter_revert(from, copied);
+		return -EFAULT;
+	}
+	return 0;
+}
+
+/**
+ * @brief Number of values in the shards, summed without their locks.
+ */
+static u32 flifo_shards_count(struct flifo_queue *q)
+{
+	struct flifo_shard __percpu *shards;
+	struct flifo_shard *shard;
+	u32 capacity = READ_ONCE(q->shard_capacity);
+	u32 used = 0;
+	int cpu;
+
+	rcu_read_lock();
+	shards = rcu_dereference(q->shards);
+	if (shards != NULL) {
+		for_each_possible_cpu(cpu) {
+			shard = per_cpu_ptr(shards, cpu);
+			used += min_t(u32, READ_ONCE(shard->head) -
+						   READ_ONCE(shard->tail),
+				      capacity);
+		}
+	}
+	rcu_read_unlock();
+
+	return used;
+}
+
+/**
+ * @brief Number of values currently in the list.
+ */
+static u32 flifo_count(struct flifo_queue *q)
+{
+	struct flifo_ring *ring;
+	u32 used;
+	u32 tail;
+
+	if (READ_ONCE(q->sync) == SYNC_SHARDED) {
+		return flifo_shards_count(q);
+	}
+	if (READ_ONCE(q->unbounded)) {
+		return READ_ONCE(q->nb_seg_values);
+	}
+
+	rcu_read_lock();
+	ring = rcu_dereference(q->ring);
+	tail = smp_load_acquire(&ring->tail);
+	used = smp_load_acquire(&ring->head) - tail;
+	rcu_read_unlock();
+
+	// The indices can be scribbled on through the mapping
+	return min_t(u32, used, READ_ONCE(q->capacity));
+}
+
+/**
+ * @brief Raise the high-water mark of the list to nb_values if needed. The
+ *        compare-and-swap only happens when the mark is actually exceeded.
+ */
+static void flifo_update_high_water(struct flifo_queue *q, u32 nb_values)
+{
+	u32 high_water = READ_ONCE(q->high_water);
+	u32 prev;
+
+	while (nb_values > high_water) {
+		prev = cmpxchg(&q->high_water, high_water, nb_values);
+		if (prev == high_water) {
+			break;
+		}
+		high_water = prev;
+	}
+}
+
+/**
+ * @brief Update the throttling state of the list after its depth changed.
+ *        Crossing the high watermark raises POLLPRI and SIGIO (POLL_PRI),
+ *        crossing back under the low watermark wakes the writers and
+ *        signals SIGIO (POLL_OUT). Costs a single load when the watermarks
+ *        are disabled.
+ */
+static void flifo_check_watermarks(struct flifo_queue *q)
+{
+	u32 high_mark = READ_ONCE(q->high_mark);
+	u32 nb_values;
+
+	if (high_mark == 0) {
+		return;
+	}
+
+	nb_values = flifo_count(q);
+	if (nb_values >= high_mark) {
+		if (!READ_ONCE(q->throttled) && !xchg(&q->throttled, 1)) {
+			kill_fasync(&q->fasync, SIGIO, POLL_PRI);
+			wake_up_interruptible_poll(&q->write_wq, EPOLLPRI);
+		}
+	} else if (nb_values <= READ_ONCE(q->low_mark)) {
+		if (READ_ONCE(q->throttled) && xchg(&q->throttled, 0)) {
+			kill_fasync(&q->fasync, SIGIO, POLL_OUT);
+			wake_up_interruptible_poll(&q->write_wq,
+						   EPOLLOUT | EPOLLWRNORM);
+		}
+	}
+}
+
+/**
+ * @brief Whether a consumer waits for flifo_notify_arrival(), so the
+ *        writers only look for the empty list when someone listens.
+ */
+static bool flifo_arrival_listened(struct flifo_queue *q)
+{
+	return READ_ONCE(q->fasync) != NULL ||
+	       rcu_access_pointer(q->eventfd) != NULL;
+}
+
+/**
+ * @brief Tell the consumers that don't sleep in the driver that values
+ *        arrived in an empty list, with SIGIO (POLL_IN) and the eventfd.
+ *        Called once per write, so a burst only costs one wakeup.
+ */
+static void flifo_notify_arrival(struct flifo_queue *q)
+{
+	struct eventfd_ctx *ctx;
+
+	kill_fasync(&q->fasync, SIGIO, POLL_IN);
+
+	rcu_read_lock();
+	ctx = rcu_dereference(q->eventfd);
+	if (ctx != NULL) {
+		eventfd_signal(ctx, 1);
+	}
+	rcu_read_unlock();
+}
+
+/**
+ * @brief Whether the stamps of the ring follow its values: not in the
+ *        priority and broadcast modes, nor once user space producers may
+ *        have written unstamped values through the mapping.
+ */
+static bool flifo_stamped(struct flifo_queue *q, int mode)
+{
+	return q->stamps != NULL && (mode == MODE_FIFO || mode == MODE_LIFO) &&
+	       !READ_ONCE(q->unstamped);
+}
+
+/**
+ * @brief Stamp the values of the ring from index from on with the current
+ *        time.
+ */
+static void flifo_stamp(struct flifo_queue *q, u32 from, u32 n)
+{
+	u64 now = ktime_get_ns();
+	u32 mask = q->capacity - 1;
+	u32 i;
+
+	for (i = 0; i < n; i++) {
+		q->stamps[(from + i) & mask] = now;
+	}
+}
+
+/**
+ * @brief Stamp all the queued values with the current time, after they
+ *        were moved or written without stamps. Must be called with both
+ *        locks held.
+ */
+static void flifo_restamp(struct flifo_queue *q)
+{
+	if (q->stamps == NULL) {
+		return;
+	}
+
+	flifo_stamp(q, q->ring->tail,
+		    ring_used(q->ring->head, q->ring->tail, q->capacity));
+	if (atomic_read(&q->nb_maps) == 0) {
+		WRITE_ONCE(q->unstamped, false);
+	}
+}
+
+/**
+ * @brief Account the time spent in the list by the values of the ring from
+ *        index from on, which are being read.
+ */
+static void flifo_record_latency(struct flifo_queue *q, u32 from, u32 n)
+{
+	u64 now = ktime_get_ns();
+	u32 mask = q->capacity - 1;
+	u32 bucket;
+	u32 i;
+
+	for (i = 0; i < n; i++) {
+		bucket = latency_bucket(now - q->stamps[(from + i) & mask],
+					LATENCY_BUCKETS);
+		this_cpu_inc(q->stats->latency[bucket]);
+	}
+}
+
+/**
+ * @brief Drop the values older than the TTL, which are the oldest ones
+ *        since the writers stamp them in order. Must be called by the
+ *        consumer (with cons_lock held in SYNC_MPMC).
+ *
+ * @param q    The list.
+ * @param mode Mode protected by the locks of the caller.
+ */
+static void flifo_expire(struct flifo_queue *q, int mode)
+{
+	unsigned long ttl_us = READ_ONCE(q->ttl_us);
+	u64 deadline;
+	u32 mask;
+	u32 tail;
+	u32 head;
+	u32 n = 0;
+
+	if (ttl_us == 0 || !flifo_stamped(q, mode)) {
+		return;
+	}
+
+	deadline = ktime_get_ns() - (u64)ttl_us * NSEC_PER_USEC;
+	head = smp_load_acquire(&q->ring->head);
+	tail = q->ring->tail;
+	mask = q->capacity - 1;
+
+	while (n < ring_used(head, tail, q->capacity) &&
+	       (s64)(q->stamps[(tail + n) & mask] - deadline) < 0) {
+		n++;
+	}
+	if (n == 0) {
+		return;
+	}
+
+	smp_store_release(&q->ring->tail, tail + n);
+	this_cpu_add(q->stats->expired, n);
+
+	if (wq_has_sleeper(&q->write_wq)) {
+		wake_up_interruptible(&q->write_wq);
+	}
+}
+
+/**
+ * @brief Set a FLIFO_RING_WAIT_* flag in the shared header.
+ */
+static void flifo_set_wait_flag(struct flifo_queue *q, u32 flag)
+{
+	struct flifo_ring *ring;
+	u32 flags;
+	u32 prev;
+
+	rcu_read_lock();
+	ring = rcu_dereference(q->ring);
+	flags = READ_ONCE(ring->flags);
+	while (!(flags & flag)) {
+		prev = cmpxchg(&ring->flags, flags, flags | flag);
+		if (prev == flags) {
+			break;
+		}
+		flags = prev;
+	}
+	rcu_read_unlock();
+}
+
+/**
+ * @brief Check whether values can be read. Otherwise, the reader is
+ *        advertised in the shared header before checking again, so a
+ *        producer working on the mapping either sees the flag and kicks
+ *        the driver, or has already published its values.
+ */
+static bool flifo_can_read(struct flifo_queue *q)
+{
+	if (flifo_count(q) != 0) {
+		return true;
+	}
+
+	flifo_set_wait_flag(q, FLIFO_RING_WAIT_READ);
+	smp_mb();
+
+	return flifo_count(q) != 0;
+}
+
+/**
+ * @brief Check whether values can be written, see flifo_can_read().
+ */
+static bool flifo_can_write(struct flifo_queue *q)
+{
+	if (flifo_count(q) < READ_ONCE(q->capacity)) {
+		return true;
+	}
+
+	flifo_set_wait_flag(q, FLIFO_RING_WAIT_WRITE);
+	smp_mb();
+
+	return flifo_count(q) < READ_ONCE(q->capacity);
+}
+
+/**
+ * @brief Whether the mode takes values from anywhere in the list, or the
+ *        writers drop the oldest values, so producers and consumers can't
+ *        work on the list at the same time.
+ */
+static bool flifo_both_locks(int mode, bool overwrite, bool reader)
+{
+	return mode == MODE_PRIO || mode == MODE_PRIO_MIN ||
+	       mode == MODE_BROADCAST || (reader && mode == MODE_LIFO) ||
+	       (!reader && overwrite);
+}
+
+/**
+ * @brief Take the locks needed by a reader or a writer in SYNC_MPMC.
+ *
+ * @return The mode protected by the locks, -ERESTARTSYS if interrupted, or
+ *         -ESTALE without the locks if the list left SYNC_MPMC or moved
+ *         its values to the segments meanwhile.
+ */
+static int flifo_lock(struct flifo_queue *q, bool reader)
+{
+	bool overwrite;
+	bool prod;
+	bool cons;
+	int mode;
+
+	for (;;) {
+		mode = READ_ONCE(q->mode);
+		overwrite = READ_ONCE(q->overwrite);
+		prod = !reader || flifo_both_locks(mode, overwrite, reader);
+		cons = reader || flifo_both_locks(mode, overwrite, reader);
+
+		if (prod && mutex_lock_interruptible(&q->prod_lock)) {
+			return -ERESTARTSYS;
+		}
+		if (cons && mutex_lock_interruptible(&q->cons_lock)) {
+			if (prod) {
+				mutex_unlock(&q->prod_lock);
+			}
+			return -ERESTARTSYS;
+		}
+
+		// The mode and the storage only change with both locks held,
+		// so any lock held is enough to see them stable
+		if (q->mode == mode && q->overwrite == overwrite &&
+		    q->sync == SYNC_MPMC && !q->unbounded) {
+			return mode;
+		}
+
+		if (cons) {
+			mutex_unlock(&q->cons_lock);
+		}
+		if (prod) {
+			mutex_unlock(&q->prod_lock);
+		}
+
+		// The caller has to dispatch again to the new storage
+		if (READ_ONCE(q->sync) != SYNC_MPMC || READ_ONCE(q->unbounded)) {
+			return -ESTALE;
+		}
+	}
+}
+
+static void flifo_unlock(struct flifo_queue *q, bool reader, int mode)
+{
+	// Still stable, the locks are held
+	bool both = flifo_both_locks(mode, q->overwrite, reader);
+
+	if (reader || both) {
+		mutex_unlock(&q->cons_lock);
+	}
+	if (!reader || both) {
+		mutex_unlock(&q->prod_lock);
+	}
+}
+
+/**
+ * @brief Start working on the ring as a reader or a writer: take the locks
+ *        in SYNC_MPMC, or only account for the task in @nb_lockless in
+ *        SYNC_SPSC, which keeps FLIFO_CMD_CHANGE_SYNC away.
+ *
+ * @return The mode of the list, -ERESTARTSYS if interrupted, or -ESTALE
+ *         if the list left the sync given by spsc, or the ring, meanwhile.
+ */
+static int flifo_ring_enter(struct flifo_queue *q, bool spsc, bool reader)
+{
+	if (!spsc) {
+		return flifo_lock(q, reader);
+	}
+
+	atomic_inc(&q->nb_lockless);
+	// Pairs with the barrier of FLIFO_CMD_CHANGE_SYNC, either it sees the
+	// task or the task sees the new sync
+	smp_mb__after_atomic();
+	if (READ_ONCE(q->sync) == SYNC_SPSC) {
+		// Only FIFO is allowed in SYNC_SPSC
+		return MODE_FIFO;
+	}
+
+	atomic_dec(&q->nb_lockless);
+	return -ESTALE;
+}
+
+static void flifo_ring_exit(struct flifo_queue *q, bool spsc, bool reader,
+			    int mode)
+{
+	if (!spsc) {
+		flifo_unlock(q, reader, mode);
+		return;
+	}
+
+	// Order the accesses to the ring before the list may leave SYNC_SPSC
+	smp_mb__before_atomic();
+	atomic_dec(&q->nb_lockless);
+}
+
+/**
+ * @brief Whether a reader has values left to read in MODE_BROADCAST.
+ */
+static bool flifo_bcast_can_read(struct flifo_file *f)
+{
+	bool can_read;
+
+	rcu_read_lock();
+	can_read = READ_ONCE(f->cursor) !=
+		   smp_load_acquire(&rcu_dereference(f->q->ring)->head);
+	rcu_read_unlock();
+
+	return can_read;
+}
+
+/**
+ * @brief Move the tail of the ring to the cursor of the slowest reader with
+ *        the SLOW_BLOCK policy, or to the head if there is none. Must be
+ *        called with both locks held.
+ */
+static void flifo_bcast_update_tail(struct flifo_queue *q)
+{
+	struct flifo_file *f;
+	u32 head = q->ring->head;
+	u32 backlog = 0;
+
+	list_for_each_entry(f, &q->readers, node) {
+		if (f->policy == SLOW_BLOCK) {
+			backlog = max_t(u32, backlog, head - f->cursor);
+		}
+	}
+
+	smp_store_release(&q->ring->tail, head - backlog);
+}
+
+/**
+ * @brief Skip the values of a reader that were overwritten by the writers,
+ *        accounting them in its lag. Must be called with both locks held.
+ */
+static void flifo_bcast_skip(struct flifo_queue *q, struct flifo_file *f)
+{
+	u32 skipped;
+
+	if (q->ring->head - f->cursor > q->capacity) {
+		skipped = q->ring->head - f->cursor - q->capacity;
+		WRITE_ONCE(f->cursor, f->cursor + skipped);
+		WRITE_ONCE(f->lag, f->lag + skipped);
+	}
+}
+
+static ssize_t flifo_read_iter(struct kiocb *iocb, struct iov_iter *to);
+
+/**
+ * @brief Read callback in MODE_BROADCAST, see flifo_read_iter(). The values
+ *        are read from the cursor of the file, and stay in the ring for the
+ *        other readers.
+ */
+static ssize_t flifo_read_broadcast(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct file *filp = iocb->ki_filp;
+	struct flifo_file *f = filp->private_data;
+	struct flifo_queue *q = f->q;
+	size_t count = iov_iter_count(to);
+	size_t nb_to_read;
+	size_t first;
+	u32 cursor;
+	u32 esz;
+	int mode;
+
+	for (;;) {
+		mode = flifo_lock(q, true);
+		if (mode == -ESTALE) {
+			return flifo_read_iter(iocb, to);
+		}
+		if (mode < 0) {
+			return mode;
+		}
+		// Switched to another mode meanwhile
+		if (mode != MODE_BROADCAST) {
+			flifo_unlock(q, true, mode);
+			return flifo_read_iter(iocb, to);
+		}
+		if (f->cursor != q->ring->head) {
+			break;
+		}
+		flifo_unlock(q, true, mode);
+
+		if (filp->f_flags & O_NONBLOCK) {
+			this_cpu_inc(q->stats->empty);
+			return -EAGAIN;
+		}
+		if (wait_event_interruptible(q->read_wq,
+					     flifo_bcast_can_read(f))) {
+			return -ERESTARTSYS;
+		}
+	}
+
+	// The size of the values may have changed before the lock was taken
+	esz = q->elem_size;
+	if (!flifo_whole_values(esz, count)) {
+		flifo_unlock(q, true, mode);
+		return -EINVAL;
+	}
+
+	flifo_bcast_skip(q, f);
+
+	cursor = f->cursor;
+	nb_to_read = min_t(size_t, flifo_nb_values(esz, count),
+			   q->ring->head - cursor);
+	first = ring_contiguous(cursor, nb_to_read, q->capacity);
+
+	if (flifo_copy_to_iter(flifo_slot(q, cursor), first * esz, to) ||
+	    flifo_copy_to_iter(q->values, (nb_to_read - first) * esz, to)) {
+		flifo_unlock(q, true, mode);
+		return -EFAULT;
+	}
+
+	WRITE_ONCE(f->cursor, cursor + nb_to_read);
+	if (f->policy == SLOW_BLOCK) {
+		flifo_bcast_update_tail(q);
+	}
+
+	flifo_unlock(q, true, mode);
+
+	this_cpu_add(q->stats->dequeues, nb_to_read);
+	flifo_check_watermarks(q);
+
+	if (wq_has_sleeper(&q->write_wq)) {
+		wake_up_interruptible(&q->write_wq);
+	}
+
+	iocb->ki_pos += nb_to_read * esz;
+
+	return nb_to_read * esz;
+}
+
+/**
+ * @brief Move up to n values to a shard, taking its lock. They are added
+ *        after the newest values, or before the oldest ones if front.
+ *
+ * @return Number of values moved, the first n ones of values.
+ */
+static u32 flifo_shard_push(struct flifo_shard *shard, u32 capacity,
+			    const int *values, u32 n, bool front)
+{
+	u32 mask = capacity - 1;
+	u32 i;
+
+	spin_lock(&shard->lock);
+	n = min_t(u32, n, capacity - (shard->head - shard->tail));
+	if (front) {
+		for (i = 0; i < n; i++) {
+			shard->values[(shard->tail - n + i) & mask] = values[i];
+		}
+		WRITE_ONCE(shard->tail, shard->tail - n);
+	} else {
+		for (i = 0; i < n; i++) {
+			shard->values[(shard->head + i) & mask] = values[i];
+		}
+		WRITE_ONCE(shard->head, shard->head + n);
+	}
+	spin_unlock(&shard->lock);
+
+	return n;
+}
+
+/**
+ * @brief Move up to n of the oldest values out of a shard, taking its lock.
+ *
+ * @return Number of values moved.
+ */
+static u32 flifo_shard_pop(struct flifo_shard *shard, u32 capacity,
+			   int *values, u32 n)
+{
+	u32 mask = capacity - 1;
+	u32 i;
+
+	spin_lock(&shard->lock);
+	n = min_t(u32, n, shard->head - shard->tail);
+	for (i = 0; i < n; i++) {
+		values[i] = shard->values[(shard->tail + i) & mask];
+	}
+	WRITE_ONCE(shard->tail, shard->tail + n);
+	spin_unlock(&shard->lock);
+
+	return n;
+}
+
+/**
+ * @brief Add values to the shard of the current CPU, then to the other
+ *        shards once it is full. Doesn't sleep.
+ *
+ * @param front Put the values back before the oldest ones, for values
+ *              taken by a reader that could not hand them out.
+ *
+ * @return Number of values added, less than n if all the shards are full
+ *         or the list left SYNC_SHARDED.
+ */
+static u32 flifo_shards_push(struct flifo_queue *q, const int *values, u32 n,
+			     bool front)
+{
+	struct flifo_shard __percpu *shards;
+	struct flifo_shard *shard;
+	u32 capacity;
+	u32 done;
+	int local;
+	int cpu;
+
+	rcu_read_lock();
+	shards = rcu_dereference(q->shards);
+	if (shards == NULL) {
+		rcu_read_unlock();
+		return 0;
+	}
+	capacity = q->shard_capacity;
+
+	// Migrating after this only costs some locality
+	local = raw_smp_processor_id();
+	done = flifo_shard_push(per_cpu_ptr(shards, local), capacity, values,
+				n, front);
+
+	for_each_possible_cpu(cpu) {
+		if (done == n) {
+			break;
+		}
+		shard = per_cpu_ptr(shards, cpu);
+		// Don't take the locks of the full shards
+		if (cpu == local || READ_ONCE(shard->head) -
+						    READ_ONCE(shard->tail) >=
+					    capacity) {
+			continue;
+		}
+		done += flifo_shard_push(shard, capacity, values + done,
+					 n - done, front);
+	}
+	rcu_read_unlock();
+
+	return done;
+}
+
+/**
+ * @brief Take values from the shard of the current CPU, then steal from the
+ *        other shards once it is empty. Doesn't sleep.
+ *
+ * @return Number of values taken, 0 if all the shards are empty or the
+ *         list left SYNC_SHARDED.
+ */
+static u32 flifo_shards_pop(struct flifo_queue *q, int *values, u32 n)
+{
+	struct flifo_shard __percpu *shards;
+	struct flifo_shard *shard;
+	u32 capacity;
+	u32 done;
+	int local;
+	int cpu;
+
+	rcu_read_lock();
+	shards = rcu_dereference(q->shards);
+	if (shards == NULL) {
+		rcu_read_unlock();
+		return 0;
+	}
+	capacity = q->shard_capacity;
+
+	local = raw_smp_processor_id();
+	done = flifo_shard_pop(per_cpu_ptr(shards, local), capacity, values, n);
+
+	for_each_possible_cpu(cpu) {
+		if (done == n) {
+			break;
+		}
+		shard = per_cpu_ptr(shards, cpu);
+		// Don't take the locks of the empty shards
+		if (cpu == local ||
+		    READ_ONCE(shard->head) == READ_ONCE(shard->tail)) {
+			continue;
+		}
+		done += flifo_shard_pop(shard, capacity, values + done,
+					n - done);
+	}
+	rcu_read_unlock();
+
+	return done;
+}
+
+static ssize_t flifo_write_iter(struct kiocb *iocb, struct iov_iter *from);
+
+/**
+ * @brief Dispatch a read or a write that found no shards again. They are
+ *        only gone while FLIFO_CMD_CHANGE_SYNC holds the locks, or once the
+ *        list left SYNC_SHARDED, so waiting for the locks is enough to see
+ *        the new sync.
+ */
+static ssize_t flifo_sharded_redispatch(struct kiocb *iocb,
+					struct iov_iter *iter, bool reader)
+{
+	struct flifo_queue *q = flifo_queue_of(iocb->ki_filp);
+
+	if (mutex_lock_interruptible(&q->prod_lock)) {
+		return -ERESTARTSYS;
+	}
+	mutex_unlock(&q->prod_lock);
+
+	return reader ? flifo_read_iter(iocb, iter) :
+			flifo_write_iter(iocb, iter);
+}
+
+/**
+ * @brief Read callback in SYNC_SHARDED, see flifo_read_iter(). The values
+ *        are taken a chunk at a time, through a bounce buffer since the
+ *        shard locks can't be held while copying to user space.
+ */
+static ssize_t flifo_read_sharded(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct file *filp = iocb->ki_filp;
+	struct flifo_queue *q = flifo_queue_of(filp);
+	int batch[LIFO_CHUNK];
+	size_t nb_to_read = iov_iter_count(to) / sizeof(int);
+	size_t done = 0;
+	u32 chunk;
+	u32 lost;
+
+	while (done < nb_to_read) {
+		chunk = flifo_shards_pop(q, batch,
+					 min_t(size_t, nb_to_read - done,
+					       LIFO_CHUNK));
+		if (chunk == 0) {
+			if (done > 0) {
+				break;
+			}
+			// Leaving SYNC_SHARDED, the values go back to the ring
+			if (rcu_access_pointer(q->shards) == NULL) {
+				return flifo_sharded_redispatch(iocb, to, true);
+			}
+			if (filp->f_flags & O_NONBLOCK) {
+				this_cpu_inc(q->stats->empty);
+				return -EAGAIN;
+			}
+			if (wait_event_interruptible(q->read_wq,
+						     flifo_can_read(q))) {
+				return -ERESTARTSYS;
+			}
+			continue;
+		}
+
+		if (flifo_copy_to_iter(batch, chunk * sizeof(int), to)) {
+			// Hand the values back as the oldest ones to whoever
+			// reads next. They are lost if the writers filled the
+			// shards, or the list left SYNC_SHARDED, meanwhile.
+			lost = chunk - flifo_shards_push(q, batch, chunk, true);
+			if (lost > 0) {
+				mutex_lock(&q->prod_lock);
+				WRITE_ONCE(q->dropped, q->dropped + lost);
+				mutex_unlock(&q->prod_lock);
+			}
+			if (done == 0) {
+				return -EFAULT;
+			}
+			break;
+		}
+		done += chunk;
+	}
+
+	this_cpu_add(q->stats->dequeues, done);
+	flifo_check_watermarks(q);
+
+	if (wq_has_sleeper(&q->write_wq)) {
+		wake_up_interruptible(&q->write_wq);
+	}
+
+	iocb->ki_pos += done * sizeof(int);
+
+	return done * sizeof(int);
+}
+
+/**
+ * @brief Write callback in SYNC_SHARDED, see flifo_write_iter(). The
+ *        high-water mark is not tracked, it would need to sum all the
+ *        shards on each write.
+ */
+static ssize_t flifo_write_sharded(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct file *filp = iocb->ki_filp;
+	struct flifo_queue *q = flifo_queue_of(filp);
+	int batch[LIFO_CHUNK];
+	size_t nb_to_write = iov_iter_count(from) / sizeof(int);
+	size_t done = 0;
+	u32 chunk;
+	u32 added;
+
+	while (done < nb_to_write) {
+		chunk = min_t(size_t, nb_to_write - done, LIFO_CHUNK);
+		if (flifo_copy_from_iter(batch, chunk * sizeof(int), from)) {
+			if (done == 0) {
+				return -EFAULT;
+			}
+			break;
+		}
+
+		added = flifo_shards_push(q, batch, chunk, false);
+		done += added;
+		if (added == chunk) {
+			continue;
+		}
+		// All the shards are full, the rest of the chunk is dropped
+		// from this call
+		iov_iter_revert(from, (chunk - added) * sizeof(int));
+		if (done > 0) {
+			break;
+		}
+		// Leaving SYNC_SHARDED, the values go back to the ring
+		if (rcu_access_pointer(q->shards) == NULL) {
+			return flifo_sharded_redispatch(iocb, from, false);
+		}
+		if (filp->f_flags & O_NONBLOCK) {
+			this_cpu_inc(q->stats->full);
+			return -ENOSPC;
+		}
+		if (wait_event_interruptible(q->write_wq,
+					     flifo_can_write(q))) {
+			return -ERESTARTSYS;
+		}
+	}
+
+	this_cpu_add(q->stats->enqueues, done);
+	flifo_check_watermarks(q);
+
+	// There is no count of all the shards to see the list go empty, every
+	// write notifies
+	if (done > 0 && flifo_arrival_listened(q)) {
+		flifo_notify_arrival(q);
+	}
+
+	if (wq_has_sleeper(&q->read_wq)) {
+		wake_up_interruptible(&q->read_wq);
+	}
+
+	iocb->ki_pos += done * sizeof(int);
+
+	return done * sizeof(int);
+}
+
+/**
+ * @brief Take a page for the segments of an unbounded list, from the free
+ *        ones if possible. Must be called with both locks held.
+ *
+ * @return The empty segment, or NULL if the memory limit is reached or the
+ *         page can't be allocated.
+ */
+static struct flifo_segment *flifo_get_segment(struct flifo_queue *q)
+{
+	struct flifo_segment *seg;
+
+	if ((q->nb_segments + 1) * PAGE_SIZE > q->memory_limit) {
+		return NULL;
+	}
+
+	seg = list_first_entry_or_null(&q->free_segments,
+				       struct flifo_segment, node);
+	if (seg != NULL) {
+		list_del(&seg->node);
+		WRITE_ONCE(q->nb_free_segments, q->nb_free_segments - 1);
+	} else {
+		seg = (struct flifo_segment *)__get_free_page(GFP_KERNEL);
+		if (seg == NULL) {
+			return NULL;
+		}
+	}
+
+	seg->head = 0;
+	seg->tail = 0;
+	list_add_tail(&seg->node, &q->segments);
+	WRITE_ONCE(q->nb_segments, q->nb_segments + 1);
+
+	return seg;
+}
+
+/**
+ * @brief Release a drained segment, keeping it for reuse if there are less
+ *        than FREE_SEGMENTS free ones and it still fits in the memory
+ *        limit. Must be called with both locks held.
+ */
+static void flifo_put_segment(struct flifo_queue *q, struct flifo_segment *seg)
+{
+	list_del(&seg->node);
+	WRITE_ONCE(q->nb_segments, q->nb_segments - 1);
+
+	if (q->nb_free_segments < FREE_SEGMENTS &&
+	    (q->nb_segments + q->nb_free_segments + 1) * PAGE_SIZE <=
+		    q->memory_limit) {
+		list_add(&seg->node, &q->free_segments);
+		WRITE_ONCE(q->nb_free_segments, q->nb_free_segments + 1);
+	} else {
+		free_page((unsigned long)seg);
+	}
+}
+
+/**
+ * @brief Free the free segments that no longer fit in the memory limit of
+ *        a list. Must be called with both locks held.
+ */
+static void flifo_trim_free_segments(struct flifo_queue *q)
+{
+	struct flifo_segment *seg;
+
+	while ((q->nb_segments + q->nb_free_segments) * PAGE_SIZE >
+		       q->memory_limit &&
+	       !list_empty(&q->free_segments)) {
+		seg = list_first_entry(&q->free_segments,
+				       struct flifo_segment, node);
+		list_del(&seg->node);
+		WRITE_ONCE(q->nb_free_segments, q->nb_free_segments - 1);
+		free_page((unsigned long)seg);
+	}
+}
+
+/**
+ * @brief Free all the segments of a list. Must be called with both locks
+ *        held.
+ */
+static void flifo_free_segments(struct flifo_queue *q)
+{
+	struct flifo_segment *seg;
+	struct flifo_segment *next;
+
+	list_splice_init(&q->free_segments, &q->segments);
+	list_for_each_entry_safe(seg, next, &q->segments, node) {
+		free_page((unsigned long)seg);
+	}
+	INIT_LIST_HEAD(&q->segments);
+	WRITE_ONCE(q->nb_segments, 0);
+	WRITE_ONCE(q->nb_free_segments, 0);
+	WRITE_ONCE(q->nb_seg_values, 0);
+}
+
+/**
+ * @brief Update the capacity of an unbounded list after its segments
+ *        changed: the values it holds, the free slots of its last segment
+ *        and the values of the pages it may still use. Must be called with
+ *        both locks held.
+ */
+static void flifo_update_seg_capacity(struct flifo_queue *q)
+{
+	struct flifo_segment *last;
+	unsigned long nb_pages = q->memory_limit / PAGE_SIZE;
+	u64 room = 0;
+
+	if (!list_empty(&q->segments)) {
+		last = list_last_entry(&q->segments, struct flifo_segment,
+				       node);
+		room = SEGMENT_VALUES - last->head;
+	}
+	// The free segments are reused before allocating new ones
+	if (nb_pages > q->nb_segments) {
+		room += (u64)(nb_pages - q->nb_segments) * SEGMENT_VALUES;
+	}
+
+	WRITE_ONCE(q->capacity,
+		   (u32)min_t(u64, q->nb_seg_values + room, U32_MAX));
+}
+
+/**
+ * @brief Drop the values of an unbounded list, releasing its segments.
+ *        Must be called with both locks held.
+ */
+static void flifo_clear_segments(struct flifo_queue *q)
+{
+	struct flifo_segment *seg;
+	struct flifo_segment *next;
+
+	list_for_each_entry_safe(seg, next, &q->segments, node) {
+		flifo_put_segment(q, seg);
+	}
+	WRITE_ONCE(q->nb_seg_values, 0);
+	flifo_update_seg_capacity(q);
+}
+
+/**
+ * @brief Append values to the segments of an unbounded list. Must be
+ *        called with both locks held.
+ *
+ * @param q      The list.
+ * @param buf    Values to append if from is NULL.
+ * @param from   Iterator to copy the values from, or NULL.
+ * @param nb     Number of values to append.
+ *
+ * @return Number of values appended, or -EFAULT if none could be copied.
+ */
+static ssize_t flifo_segments_push(struct flifo_queue *q, const int *buf,
+				   struct iov_iter *from, size_t nb)
+{
+	struct flifo_segment *seg;
+	size_t done = 0;
+	size_t chunk;
+
+	while (done < nb) {
+		seg = list_empty(&q->segments) ?
+			      NULL :
+			      list_last_entry(&q->segments,
+					      struct flifo_segment, node);
+		if (seg == NULL || seg->head == SEGMENT_VALUES) {
+			seg = flifo_get_segment(q);
+			if (seg == NULL) {
+				break;
+			}
+		}
+
+		chunk = min_t(size_t, nb - done, SEGMENT_VALUES - seg->head);
+		if (from != NULL) {
+			if (flifo_copy_from_iter(&seg->values[seg->head],
+						 chunk * sizeof(int), from)) {
+				if (done == 0) {
+					return -EFAULT;
+				}
+				break;
+			}
+		} else {
+			memcpy(&seg->values[seg->head], buf + done,
+			       chunk * sizeof(int));
+		}
+
+		seg->head += chunk;
+		done += chunk;
+	}
+
+	WRITE_ONCE(q->nb_seg_values, q->nb_seg_values + done);
+	flifo_update_seg_capacity(q);
+
+	return done;
+}
+
+/**
+ * @brief Remove the oldest values from the segments of an unbounded list,
+ *        releasing the drained segments. Must be called with both locks
+ *        held.
+ *
+ * @param q      The list.
+ * @param buf    Where to copy the values if to is NULL.
+ * @param to     Iterator to copy the values to, or NULL.
+ * @param nb     Maximum number of values to remove.
+ *
+ * @return Number of values removed, or -EFAULT if none could be copied.
+ */
+static ssize_t flifo_segments_pop(struct flifo_queue *q, int *buf,
+				  struct iov_iter *to, size_t nb)
+{
+	struct flifo_segment *seg;
+	size_t done = 0;
+	size_t chunk;
+
+	nb = min_t(size_t, nb, q->nb_seg_values);
+
+	while (done < nb) {
+		seg = list_first_entry(&q->segments, struct flifo_segment,
+				       node);
+
+		chunk = min_t(size_t, nb - done, seg->head - seg->tail);
+		if (to != NULL) {
+			if (flifo_copy_to_iter(&seg->values[seg->tail],
+					       chunk * sizeof(int), to)) {
+				if (done == 0) {
+					return -EFAULT;
+				}
+				break;
+			}
+		} else {
+			memcpy(buf + done, &seg->values[seg->tail],
+			       chunk * sizeof(int));
+		}
+
+		seg->tail += chunk;
+		done += chunk;
+
+		// Only the last segment can be partly written, it is kept
+		if (seg->tail == seg->head) {
+			if (list_is_last(&seg->node, &q->segments)) {
+				seg->head = 0;
+				seg->tail = 0;
+			} else {
+				flifo_put_segment(q, seg);
+			}
+		}
+	}
+
+	WRITE_ONCE(q->nb_seg_values, q->nb_seg_values - done);
+	flifo_update_seg_capacity(q);
+
+	return done;
+}
+
+/**
+ * @brief Take both locks for a reader or a writer of an unbounded list.
+ *
+ * @return 0 with the locks held, 1 without them if the list isn't
+ *         unbounded anymore, or -ERESTARTSYS if interrupted.
+ */
+static int flifo_lock_segments(struct flifo_queue *q)
+{
+	if (mutex_lock_interruptible(&q->prod_lock)) {
+		return -ERESTARTSYS;
+	}
+	if (mutex_lock_interruptible(&q->cons_lock)) {
+		mutex_unlock(&q->prod_lock);
+		return -ERESTARTSYS;
+	}
+
+	if (!q->unbounded) {
+		mutex_unlock(&q->cons_lock);
+		mutex_unlock(&q->prod_lock);
+		return 1;
+	}
+
+	return 0;
+}
+
+static void flifo_unlock_segments(struct flifo_queue *q)
+{
+	mutex_unlock(&q->cons_lock);
+	mutex_unlock(&q->prod_lock);
+}
+
+/**
+ * @brief Read callback of an unbounded list, see flifo_read_iter().
+ */
+static ssize_t flifo_read_segments(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct file *filp = iocb->ki_filp;
+	struct flifo_queue *q = flifo_queue_of(filp);
+	ssize_t nb_read;
+	int err;
+
+	for (;;) {
+		err = flifo_lock_segments(q);
+		if (err < 0) {
+			return err;
+		}
+		// Switched back to the ring meanwhile
+		if (err > 0) {
+			return flifo_read_iter(iocb, to);
+		}
+		if (q->nb_seg_values != 0) {
+			break;
+		}
+		flifo_unlock_segments(q);
+
+		if (filp->f_flags & O_NONBLOCK) {
+			this_cpu_inc(q->stats->empty);
+			return -EAGAIN;
+		}
+		if (wait_event_interruptible(q->read_wq, flifo_can_read(q))) {
+			return -ERESTARTSYS;
+		}
+	}
+
+	nb_read = flifo_segments_pop(q, NULL, to,
+				     iov_iter_count(to) / sizeof(int));
+	flifo_unlock_segments(q);
+	if (nb_read < 0) {
+		return nb_read;
+	}
+
+	this_cpu_add(q->stats->dequeues, nb_read);
+	flifo_check_watermarks(q);
+
+	if (wq_has_sleeper(&q->write_wq)) {
+		wake_up_interruptible(&q->write_wq);
+	}
+
+	iocb->ki_pos += nb_read * sizeof(int);
+
+	return nb_read * sizeof(int);
+}
+
+/**
+ * @brief Write callback of an unbounded list, see flifo_write_iter(). The
+ *        call only waits, or fails with -ENOSPC, once the memory limit is
+ *        reached.
+ */
+static ssize_t flifo_write_segments(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct file *filp = iocb->ki_filp;
+	struct flifo_queue *q = flifo_queue_of(filp);
+	size_t nb_to_write;
+	ssize_t nb_written;
+	u32 nb_values;
+	int err;
+
+	for (;;) {
+		err = flifo_lock_segments(q);
+		if (err < 0) {
+			return err;
+		}
+		if (err > 0) {
+			return flifo_write_iter(iocb, from);
+		}
+		if (q->nb_seg_values < q->capacity) {
+			break;
+		}
+		flifo_unlock_segments(q);
+
+		if (filp->f_flags & O_NONBLOCK) {
+			this_cpu_inc(q->stats->full);
+			return -ENOSPC;
+		}
+		if (wait_event_interruptible(q->write_wq,
+					     flifo_can_write(q))) {
+			return -ERESTARTSYS;
+		}
+	}
+
+	nb_to_write = min_t(size_t, iov_iter_count(from) / sizeof(int),
+			    q->capacity - q->nb_seg_values);
+	nb_written = flifo_segments_push(q, NULL, from, nb_to_write);
+	nb_values = q->nb_seg_values;
+	flifo_unlock_segments(q);
+	if (nb_written < 0) {
+		return nb_written;
+	}
+	// The limit allowed a page, but the allocation failed
+	if (nb_written == 0) {
+		return -ENOMEM;
+	}
+
+	this_cpu_add(q->stats->enqueues, nb_written);
+	flifo_update_high_water(q, nb_values);
+	flifo_check_watermarks(q);
+
+	// Only these values are in the list, both locks were held
+	if (nb_values == nb_written) {
+		flifo_notify_arrival(q);
+	}
+
+	if (wq_has_sleeper(&q->read_wq)) {
+		wake_up_interruptible(&q->read_wq);
+	}
+
+	iocb->ki_pos += nb_written * sizeof(int);
+
+	return nb_written * sizeof(int);
+}
+
+/**
+ * @brief Device file read callback to read values from the list.
+ *        As many whole values as fit in the userspace buffer are read, in
+ *        the order given by the current mode (the largest or smallest
+ *        values first in the priority modes). If the list is empty, the call
+ *        sleeps until a value is written (or fails with -EAGAIN when the file
+ *        is opened with O_NONBLOCK). Also used by splice() to move the values
+ *        to a pipe.
+ *
+ * @param iocb  I/O control block, with the file of the char device from
+ *              which the values are read.
+ * @param to    Buffer to which the values will be copied. Its size must be a
+ *              multiple of the size of the values.
+ *
+ * @return Number of bytes written in the buffer.
+ */
+static ssize_t flifo_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct file *filp = iocb->ki_filp;
+	struct flifo_queue *q = flifo_queue_of(filp);
+	size_t count = iov_iter_count(to);
+	bool spsc = READ_ONCE(q->sync) == SYNC_SPSC;
+	int batch[LIFO_CHUNK] __aligned(sizeof(u64));
+	size_t nb_to_read;
+	size_t first;
+	size_t chunk;
+	size_t done;
+	u32 tail;
+	u32 head;
+	u32 esz;
+	size_t i;
+	int mode;
+
+	// Only whole values can be read
+	if (!flifo_whole_values(READ_ONCE(q->elem_size), count)) {
+		return -EINVAL;
+	}
+
+	if (READ_ONCE(q->sync) == SYNC_SHARDED) {
+		return flifo_read_sharded(iocb, to);
+	}
+	if (READ_ONCE(q->unbounded)) {
+		return flifo_read_segments(iocb, to);
+	}
+	if (READ_ONCE(q->mode) == MODE_BROADCAST) {
+		return flifo_read_broadcast(iocb, to);
+	}
+
+	mode = flifo_ring_enter(q, spsc, true);
+	if (mode == -ESTALE) {
+		return flifo_read_iter(iocb, to);
+	}
+	if (mode < 0) {
+		return mode;
+	}
+	flifo_expire(q, mode);
+
+	// The buffer is empty, wait for a writer unless the file is non-blocking
+	while (mode == MODE_BROADCAST || flifo_count(q) == 0) {
+		flifo_ring_exit(q, spsc, true, mode);
+		// Each reader has its own cursor
+		if (mode == MODE_BROADCAST) {
+			return flifo_read_broadcast(iocb, to);
+		}
+
+		if (filp->f_flags & O_NONBLOCK) {
+			this_cpu_inc(q->stats->empty);
+			return -EAGAIN;
+		}
+		if (wait_event_interruptible(q->read_wq, flifo_can_read(q))) {
+			return -ERESTARTSYS;
+		}
+
+		mode = flifo_ring_enter(q, spsc, true);
+		if (mode == -ESTALE) {
+			return flifo_read_iter(iocb, to);
+		}
+		if (mode < 0) {
+			return mode;
+		}
+		flifo_expire(q, mode);
+	}
+
+	// The size of the values only changes with both locks held and the
+	// list empty, which may have happened before the lock was taken
+	esz = q->elem_size;
+	if (!flifo_whole_values(esz, count)) {
+		flifo_ring_exit(q, spsc, true, mode);
+		return -EINVAL;
+	}
+
+	// Values up to head have been published by the producers
+	head = smp_load_acquire(&q->ring->head);
+	tail = q->ring->tail;
+	nb_to_read = min_t(size_t, flifo_nb_values(esz, count),
+			   ring_used(head, tail, q->capacity));
+
+	if (mode == MODE_FIFO) {
+		// Copy straight from the ring, in at most two chunks
+		first = ring_contiguous(tail, nb_to_read, q->capacity);
+
+		if (flifo_copy_to_iter(flifo_slot(q, tail), first * esz, to) ||
+		    flifo_copy_to_iter(q->values, (nb_to_read - first) * esz,
+				       to)) {
+			flifo_ring_exit(q, spsc, true, mode);
+			return -EFAULT;
+		}
+
+		if (flifo_stamped(q, mode)) {
+			flifo_record_latency(q, tail, nb_to_read);
+		}
+
+		// Hand the slots back to the producers
+		smp_store_release(&q->ring->tail, tail + nb_to_read);
+	} else if (mode == MODE_LIFO) {
+		// Gather the newest values first, a chunk at a time
+		for (done = 0; done < nb_to_read; done += chunk) {
+			chunk = min_t(size_t, nb_to_read - done,
+				      sizeof(batch) / esz);
+
+			ring_gather_lifo(q->values, esz, q->capacity, batch,
+					 head - done, chunk);
+
+			if (flifo_copy_to_iter(batch, chunk * esz, to)) {
+				break;
+			}
+		}
+
+		// Only consume the values that reached the user
+		if (done == 0) {
+			flifo_ring_exit(q, spsc, true, mode);
+			return -EFAULT;
+		}
+		nb_to_read = done;
+
+		if (flifo_stamped(q, mode)) {
+			flifo_record_latency(q, head - nb_to_read, nb_to_read);
+		}
+
+		smp_store_release(&q->ring->head, head - nb_to_read);
+	} else {
+		// The heap sits at the start of the ring (tail is 0), extract
+		// the values a chunk at a time
+		for (done = 0; done < nb_to_read; done += chunk) {
+			chunk = min_t(size_t, nb_to_read - done, LIFO_CHUNK);
+
+			for (i = 0; i < chunk; i++) {
+				batch[i] = heap_pop(q->values, head - i, mode);
+			}
+
+			if (flifo_copy_to_iter(batch, chunk * sizeof(int), to)) {
+				// Put the values of this chunk back
+				for (i = 0; i < chunk; i++) {
+					heap_push(q->values, head - chunk + i,
+						  batch[i], mode);
+				}
+				break;
+			}
+
+			head -= chunk;
+		}
+
+		smp_store_release(&q->ring->head, head);
+
+		if (done == 0) {
+			flifo_ring_exit(q, spsc, true, mode);
+			return -EFAULT;
+		}
+		nb_to_read = done;
+	}
+
+	flifo_ring_exit(q, spsc, true, mode);
+
+	this_cpu_add(q->stats->dequeues, nb_to_read);
+	flifo_check_watermarks(q);
+
+	// Some space has been freed for the writers
+	if (wq_has_sleeper(&q->write_wq)) {
+		wake_up_interruptible(&q->write_wq);
+	}
+
+	iocb->ki_pos += nb_to_read * esz; // Update the cursor position
+
+	// Return the number of bytes written in the buffer
+	return nb_to_read * esz;
+}
+
+/**
+ * @brief Device file write callback to add values to the list.
+ *        As many whole values as there is free space in the list are written.
+ *        If the list is full, the call sleeps until a value is read (or fails
+ *        with -ENOSPC when the file is opened with O_NONBLOCK). In overwrite
+ *        mode, the oldest values are dropped instead and the call never
+ *        waits. Also used by splice() to move the values from a pipe.
+ *
+ * @param iocb  I/O control block, with the file of the char device to which
+ *              the values are written.
+ * @param from  Buffer from which the values will be copied. Its size must be
+ *              a multiple of the size of the values.
+ *
+ * @return Number of bytes read from the buffer.
+ */
+static ssize_t flifo_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct file *filp = iocb->ki_filp;
+	struct flifo_queue *q = flifo_queue_of(filp);
+	size_t count = iov_iter_count(from);
+	bool spsc = READ_ONCE(q->sync) == SYNC_SPSC;
+	size_t nb_to_write;
+	size_t first;
+	size_t i;
+	u32 drop;
+	u32 tail;
+	u32 head;
+	u32 esz;
+	bool arrived = false;
+	int mode;
+
+	// Only whole values can be written
+	if (!flifo_whole_values(READ_ONCE(q->elem_size), count)) {
+		return -EINVAL;
+	}
+
+	if (READ_ONCE(q->sync) == SYNC_SHARDED) {
+		return flifo_write_sharded(iocb, from);
+	}
+	if (READ_ONCE(q->unbounded)) {
+		return flifo_write_segments(iocb, from);
+	}
+
+	mode = flifo_ring_enter(q, spsc, false);
+	if (mode == -ESTALE) {
+		return flifo_write_iter(iocb, from);
+	}
+	if (mode < 0) {
+		return mode;
+	}
+
+	// There is no more space in the buffer, wait for a reader unless the
+	// file is non-blocking or the oldest values can be dropped
+	while (!q->overwrite && flifo_count(q) >= READ_ONCE(q->capacity)) {
+		flifo_ring_exit(q, spsc, false, mode);
+
+		if (filp->f_flags & O_NONBLOCK) {
+			this_cpu_inc(q->stats->full);
+			return -ENOSPC;
+		}
+		if (wait_event_interruptible(q->write_wq,
+					     flifo_can_write(q))) {
+			return -ERESTARTSYS;
+		}
+
+		mode = flifo_ring_enter(q, spsc, false);
+		if (mode == -ESTALE) {
+			return flifo_write_iter(iocb, from);
+		}
+		if (mode < 0) {
+			return mode;
+		}
+	}
+
+	// The size of the values may have changed before the lock was taken
+	esz = q->elem_size;
+	if (!flifo_whole_values(esz, count)) {
+		flifo_ring_exit(q, spsc, false, mode);
+		return -EINVAL;
+	}
+
+	// Slots before tail have been released by the consumers
+	tail = smp_load_acquire(&q->ring->tail);
+	head = q->ring->head;
+	nb_to_write = min_t(size_t, flifo_nb_values(esz, count),
+			    q->capacity - ring_used(head, tail, q->capacity));
+
+	// Make room by dropping the oldest values, both locks are held
+	if (q->overwrite) {
+		nb_to_write = min_t(size_t, flifo_nb_values(esz, count),
+				    q->capacity);
+		drop = head - tail + nb_to_write > q->capacity ?
+			       head - tail + nb_to_write - q->capacity :
+			       0;
+
+		tail += drop;
+		smp_store_release(&q->ring->tail, tail);
+		q->dropped += drop;
+	}
+
+	// Copy straight into the free slots, in at most two chunks
+	first = ring_contiguous(head, nb_to_write, q->capacity);
+	if (flifo_copy_from_iter(flifo_slot(q, head), first * esz, from) ||
+	    flifo_copy_from_iter(q->values, (nb_to_write - first) * esz,
+				 from)) {
+		flifo_ring_exit(q, spsc, false, mode);
+		return -EFAULT;
+	}
+
+	if (flifo_stamped(q, mode)) {
+		flifo_stamp(q, head, nb_to_write);
+	}
+
+	// In the priority modes the heap sits at the start of the ring (tail
+	// is 0), the new values only have to be moved up to their place
+	if (mode == MODE_PRIO || mode == MODE_PRIO_MIN) {
+		for (i = 0; i < nb_to_write; i++) {
+			heap_sift_up(q->values, head + i, mode);
+		}
+	}
+
+	// Publish the new values to the consumers
+	smp_store_release(&q->ring->head, head + nb_to_write);
+
+	// Without a reader holding them, the values are only kept in the ring
+	// until overwritten
+	if (mode == MODE_BROADCAST) {
+		flifo_bcast_update_tail(q);
+	}
+
+	// The list was empty when the values were published if the readers
+	// have reached the old head since. The barrier orders the publication
+	// before the check of tail.
+	if (flifo_arrival_listened(q)) {
+		smp_mb();
+		arrived = (s32)(smp_load_acquire(&q->ring->tail) - head) >= 0;
+	}
+
+	flifo_ring_exit(q, spsc, false, mode);
+
+	this_cpu_add(q->stats->enqueues, nb_to_write);
+	flifo_update_high_water(q, head + nb_to_write - tail);
+	flifo_check_watermarks(q);
+
+	if (arrived) {
+		flifo_notify_arrival(q);
+	}
+
+	// There are new values for the readers
+	if (wq_has_sleeper(&q->read_wq)) {
+		wake_up_interruptible(&q->read_wq);
+	}
+
+	iocb->ki_pos += nb_to_write * esz;
+
+	return nb_to_write * esz;
+}
+
+/**
+ * @brief Allocate a zeroed ring that can be remapped to user space.
+ *
+ * @param nb_slots Number of values of the ring, a power of 2.
+ * @param esz      Size of a value in bytes.
+ *
+ * @return The header of the ring, or NULL on allocation failure.
+ */
+static struct flifo_ring *flifo_alloc_ring(u32 nb_slots, u32 esz)
+{
+	struct flifo_ring *ring;
+
+	ring = vmalloc_user(PAGE_SIZE + PAGE_ALIGN((size_t)nb_slots * esz));
+	if (ring == NULL) {
+		return NULL;
+	}
+
+	ring->capacity = nb_slots;
+	ring->data_offset = PAGE_SIZE;
+	return ring;
+}
+
+/**
+ * @brief Move the queued values to the start of the ring, in order. Must be
+ *        called with both locks held.
+ *
+ * @param q The list to linearize.
+ */
+static void flifo_linearize(struct flifo_queue *q)
+{
+	u32 nb_values = ring_used(q->ring->head, q->ring->tail, q->capacity);
+
+	ring_rotate(q->values, q->capacity, q->ring->tail & (q->capacity - 1));
+	q->ring->tail = 0;
+	q->ring->head = nb_values;
+}
+
+/**
+ * @brief Replace the ring by one of a new capacity, moving the queued values
+ *        in order to its start. Must be called with both locks held.
+ *
+ * @param q            The list to resize.
+ * @param new_capacity Requested capacity, rounded up to a power of 2.
+ * @param esz          Size of the values of the new ring, only different
+ *                     from the current one when the list is empty.
+ *
+ * @return 0 on success, a negative error code otherwise.
+ */
+static int flifo_resize(struct flifo_queue *q, unsigned long new_capacity,
+			u32 esz)
+{
+	struct flifo_ring *old = q->ring;
+	struct flifo_ring *ring;
+	u64 *stamps = NULL;
+	int *values;
+	u32 nb_values;
+	u32 mask = q->capacity - 1;
+	u32 i;
+
+	if (new_capacity == 0 || new_capacity > MAX_CAPACITY) {
+		return -EINVAL;
+	}
+	new_capacity = roundup_pow_of_two(new_capacity);
+	if ((u64)new_capacity * esz > MAX_RING_SIZE) {
+		return -EINVAL;
+	}
+
+	// The ring can't be swapped under lockless or user space users, nor
+	// while the values are in the shards or the segments, nor under the
+	// cursors of the readers
+	if (q->sync != SYNC_MPMC || q->unbounded ||
+	    q->mode == MODE_BROADCAST || atomic_read(&q->nb_maps) > 0) {
+		return -EBUSY;
+	}
+
+	nb_values = ring_used(old->head, old->tail, q->capacity);
+	if (nb_values > new_capacity) {
+		return -ENOSPC;
+	}
+
+	ring = flifo_alloc_ring(new_capacity, esz);
+	if (ring == NULL) {
+		return -ENOMEM;
+	}
+	if (q->stamps != NULL) {
+		stamps = vmalloc(new_capacity * sizeof(u64));
+		if (stamps == NULL) {
+			vfree(ring);
+			return -ENOMEM;
+		}
+	}
+
+	values = RING_VALUES(ring);
+	ring_read(q->values, q->elem_size, q->capacity, old->tail, values,
+		  nb_values);
+	if (stamps != NULL) {
+		for (i = 0; i < nb_values; i++) {
+			stamps[i] = q->stamps[(old->tail + i) & mask];
+		}
+		vfree(q->stamps);
+		q->stamps = stamps;
+	}
+	ring->head = nb_values;
+
+	WRITE_ONCE(q->capacity, new_capacity);
+	WRITE_ONCE(q->elem_size, esz);
+	q->values = values;
+	rcu_assign_pointer(q->ring, ring);
+
+	// Wait for the lockless readers of the old header before freeing it
+	synchronize_rcu();
+	vfree(old);
+
+	return 0;
+}
+
+/**
+ * @brief Free the shards and their values.
+ */
+static void flifo_free_shards(struct flifo_shard __percpu *shards)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		kvfree(per_cpu_ptr(shards, cpu)->values);
+	}
+	free_percpu(shards);
+}
+
+/**
+ * @brief Switch the list to SYNC_SHARDED, spreading the queued values over
+ *        new shards in order. Each CPU gets a shard of an equal part of the
+ *        capacity, rounded up to a power of 2. Must be called with both
+ *        locks held.
+ *
+ * @param q The list to shard.
+ *
+ * @return 0 on success, -ENOMEM if the shards can't be allocated.
+ */
+static int flifo_shard(struct flifo_queue *q)
+{
+	struct flifo_shard __percpu *shards;
+	struct flifo_shard *shard;
+	u32 nb_values = ring_used(q->ring->head, q->ring->tail, q->capacity);
+	u32 mask = q->capacity - 1;
+	u32 shard_capacity;
+	u32 done = 0;
+	u32 i;
+	int cpu;
+
+	shard_capacity = roundup_pow_of_two(DIV_ROUND_UP(q->capacity,
+							 num_possible_cpus()));
+
+	shards = alloc_percpu(struct flifo_shard);
+	if (shards == NULL) {
+		return -ENOMEM;
+	}
+
+	for_each_possible_cpu(cpu) {
+		shard = per_cpu_ptr(shards, cpu);
+		spin_lock_init(&shard->lock);
+		shard->values = kvmalloc_node(shard_capacity * sizeof(int),
+					      GFP_KERNEL, cpu_to_node(cpu));
+		if (shard->values == NULL) {
+			flifo_free_shards(shards);
+			return -ENOMEM;
+		}
+
+		// The shards hold at least the capacity of the ring
+		for (i = 0; i < shard_capacity && done < nb_values; i++) {
+			shard->values[i] =
+				q->values[(q->ring->tail + done++) & mask];
+		}
+		shard->head = i;
+	}
+
+	q->ring->head = 0;
+	q->ring->tail = 0;
+	q->shard_capacity = shard_capacity;
+	WRITE_ONCE(q->capacity, shard_capacity * num_possible_cpus());
+	rcu_assign_pointer(q->shards, shards);
+
+	return 0;
+}
+
+/**
+ * @brief Leave SYNC_SHARDED, gathering the values of the shards at the
+ *        start of the ring. Must be called with both locks held.
+ *
+ * @param q The list to unshard.
+ *
+ * @return 0 on success, -ENOSPC if the values don't fit in the ring.
+ */
+static int flifo_unshard(struct flifo_queue *q)
+{
+	struct flifo_shard __percpu *shards = q->shards;
+	struct flifo_shard *shard;
+	u32 capacity = q->ring->capacity;
+	u32 nb_values = 0;
+	u32 mask = q->shard_capacity - 1;
+	u32 i;
+	int cpu;
+
+	// Wait for the readers and writers still working on the shards
+	RCU_INIT_POINTER(q->shards, NULL);
+	synchronize_rcu();
+
+	for_each_possible_cpu(cpu) {
+		shard = per_cpu_ptr(shards, cpu);
+		nb_values += shard->head - shard->tail;
+	}
+	if (nb_values > capacity) {
+		rcu_assign_pointer(q->shards, shards);
+		return -ENOSPC;
+	}
+
+	nb_values = 0;
+	for_each_possible_cpu(cpu) {
+		shard = per_cpu_ptr(shards, cpu);
+		for (i = shard->tail; i != shard->head; i++) {
+			q->values[nb_values++] = shard->values[i & mask];
+		}
+	}
+	q->ring->tail = 0;
+	q->ring->head = nb_values;
+	WRITE_ONCE(q->capacity, capacity);
+	flifo_restamp(q);
+
+	flifo_free_shards(shards);
+
+	return 0;
+}
+
+/**
+ * @brief Store the values of the list in segments allocated on demand, up
+ *        to memory_limit bytes, or only change the limit if the list is
+ *        already unbounded. The queued values are moved from the ring.
+ *        Must be called with both locks held.
+ *
+ * @param q            The list.
+ * @param memory_limit Maximum number of bytes of the segments.
+ *
+ * @return 0 on success, -ENOSPC if the queued values don't fit in the
+ *         limit.
+ */
+static int flifo_set_unbounded(struct flifo_queue *q,
+			       unsigned long memory_limit)
+{
+	u32 nb_values = ring_used(q->ring->head, q->ring->tail, q->capacity);
+	u32 mask = q->capacity - 1;
+	u32 first;
+
+	if (memory_limit < PAGE_SIZE) {
+		return -EINVAL;
+	}
+
+	q->memory_limit = memory_limit;
+	if (q->unbounded) {
+		// Writes wait until enough segments are drained if the limit
+		// is now under the footprint
+		flifo_trim_free_segments(q);
+		flifo_update_seg_capacity(q);
+		return 0;
+	}
+
+	if (DIV_ROUND_UP(nb_values, SEGMENT_VALUES) * PAGE_SIZE >
+	    memory_limit) {
+		return -ENOSPC;
+	}
+
+	first = ring_contiguous(q->ring->tail, nb_values, q->capacity);
+	if (flifo_segments_push(q, &q->values[q->ring->tail & mask], NULL,
+				first) != first ||
+	    flifo_segments_push(q, q->values, NULL, nb_values - first) !=
+		    nb_values - first) {
+		// The pushes accounted the segments in the capacity
+		flifo_free_segments(q);
+		WRITE_ONCE(q->capacity, q->ring->capacity);
+		return -ENOMEM;
+	}
+
+	q->ring->head = 0;
+	q->ring->tail = 0;
+	WRITE_ONCE(q->unbounded, true);
+	flifo_update_seg_capacity(q);
+
+	return 0;
+}
+
+/**
+ * @brief Move the values of an unbounded list back to the start of the
+ *        ring, and free its segments. Must be called with both locks held.
+ *
+ * @param q The list.
+ *
+ * @return 0 on success, -ENOSPC if the values don't fit in the ring.
+ */
+static int flifo_set_bounded(struct flifo_queue *q)
+{
+	u32 nb_values = q->nb_seg_values;
+
+	if (nb_values > q->ring->capacity) {
+		return -ENOSPC;
+	}
+
+	flifo_segments_pop(q, q->values, NULL, nb_values);
+	flifo_free_segments(q);
+
+	q->ring->tail = 0;
+	q->ring->head = nb_values;
+	WRITE_ONCE(q->capacity, q->ring->capacity);
+	WRITE_ONCE(q->unbounded, false);
+	flifo_restamp(q);
+
+	return 0;
+}
+
+/**
+ * @brief Number of bytes used by the values of the list: its ring and, if
+ *        any, its shards or segments.
+ */
+static unsigned long flifo_footprint(struct flifo_queue *q)
+{
+	unsigned long footprint;
+
+	rcu_read_lock();
+	footprint = PAGE_SIZE +
+		    PAGE_ALIGN((size_t)rcu_dereference(q->ring)->capacity *
+			       READ_ONCE(q->elem_size));
+	rcu_read_unlock();
+
+	if (READ_ONCE(q->sync) == SYNC_SHARDED) {
+		footprint += (unsigned long)READ_ONCE(q->shard_capacity) *
+			     sizeof(int) * num_possible_cpus();
+	}
+	footprint += (READ_ONCE(q->nb_segments) +
+		      READ_ONCE(q->nb_free_segments)) *
+		     PAGE_SIZE;
+
+	return footprint;
+}
+
+/**
+ * @brief Gather the statistics of the list.
+ *
+ * @param q     The list.
+ * @param stats Filled with the sum of the per-CPU counters and the state of
+ *              the list.
+ */
+static void flifo_get_stats(struct flifo_queue *q, struct flifo_stats *stats)
+{
+	struct flifo_pcpu_stats *pcpu;
+	int cpu;
+
+	memset(stats, 0, sizeof(*stats));
+
+	for_each_possible_cpu(cpu) {
+		pcpu = per_cpu_ptr(q->stats, cpu);
+		stats->enqueues += READ_ONCE(pcpu->enqueues);
+		stats->dequeues += READ_ONCE(pcpu->dequeues);
+		stats->full += READ_ONCE(pcpu->full);
+		stats->empty += READ_ONCE(pcpu->empty);
+		stats->expired += READ_ONCE(pcpu->expired);
+	}
+
+	stats->mode_switches = READ_ONCE(q->mode_switches);
+	stats->dropped = READ_ONCE(q->dropped);
+	stats->depth = flifo_count(q);
+	stats->high_water = READ_ONCE(q->high_water);
+}
+
+/**
+ * @brief Clear the statistics of the list. The high-water mark restarts
+ *        from the current depth. Counts racing with the reset may be lost.
+ *
+ * @param q The list.
+ */
+static void flifo_reset_stats(struct flifo_queue *q)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		memset(per_cpu_ptr(q->stats, cpu), 0,
+		       sizeof(struct flifo_pcpu_stats));
+	}
+
+	WRITE_ONCE(q->mode_switches, 0);
+	WRITE_ONCE(q->dropped, 0);
+	WRITE_ONCE(q->high_water, flifo_count(q));
+}
+
 /**
- * @brief Device file read callback to read the value in the list.
+ * @brief Device file ioctl callback. This permits to modify the behavior of the module.
+ *        - If the command is FLIFO_CMD_RESET, then the list is reset.
+ *        - If the command is FLIFO_CMD_CHANGE_MODE, then the arguments will determine
+ *          the list's mode between FIFO (MODE_FIFO), LIFO (MODE_LIFO),
+ *          largest (MODE_PRIO) or smallest (MODE_PRIO_MIN) value first, and
+ *          FIFO for each reader (MODE_BROADCAST)
+ *        - If the command is FLIFO_CMD_CHANGE_SYNC, then the argument will
+ *          determine whether the producers and consumers are serialised
+ *          (SYNC_MPMC), not (SYNC_SPSC), or spread over one shard per CPU
+ *          (SYNC_SHARDED). Leaving SYNC_SPSC fails with -EBUSY while a
+ *          read or write is working on the ring, the blocked ones are
+ *          moved to the new sync.
+ *        - If the command is FLIFO_CMD_KICK, then the tasks flagged as
+ *          waiting in the shared ring header are woken up.
+ *        - If the command is FLIFO_CMD_RESIZE, then the argument is the new
+ *          capacity of the list. The queued values are kept.
+ *        - If the command is FLIFO_CMD_GET_STATS, then the statistics of the
+ *          list are copied to the struct flifo_stats pointed by the argument.
+ *        - If the command is FLIFO_CMD_RESET_STATS, then the statistics of
+ *          the list are cleared.
+ *        - If the command is FLIFO_CMD_SET_OVERWRITE, then a non-zero
+ *          argument makes the writers drop the oldest values of a full list
+ *          instead of waiting or failing.
+ *        - If the command is FLIFO_CMD_GET_DROPPED, then the number of values
+ *          dropped in overwrite mode is copied to the __u64 pointed by the
+ *          argument.
+ *        - If the command is FLIFO_CMD_SET_WATERMARKS, then the low and high
+ *          watermarks are read from the struct flifo_watermarks pointed by
+ *          the argument. A high watermark of 0 disables them.
+ *        - If the command is FLIFO_CMD_SET_UNBOUNDED, then a non-zero
+ *          argument stores the values in pages allocated on demand, up to
+ *          that number of bytes. 0 moves them back to the ring.
+ *        - If the command is FLIFO_CMD_SET_SLOW_POLICY, then the argument
+ *          determines whether the writers wait for this file in
+ *          MODE_BROADCAST (SLOW_BLOCK), or overwrite the values it didn't
+ *          read yet (SLOW_DROP).
+ *        - If the command is FLIFO_CMD_GET_LAG, then the number of values
+ *          skipped by this file with SLOW_DROP is copied to the __u64
+ *          pointed by the argument.
+ *        - If the command is FLIFO_CMD_SET_TTL, then the argument is the age
+ *          in microseconds after which the readers drop a value, 0 to keep
+ *          them.
  *
- * @param filp  File structure of the char device from which the value is read.
- * @param buf   Userspace buffer to which the value will be copied.
- * @param count Number of available bytes in the userspace buffer.
- * @param ppos  Current cursor position in the file (ignored).
+ * @param filp File structure of the char device to which ioctl is performed.
+ * @param cmd  Command value of the ioctl
+ * @param arg  Optionnal argument of the ioctl
  *
- * @return Number of bytes written in the userspace buffer.
+ * @return 0 if ioctl succeed, -1 otherwise.
  */
-static ssize_t flifo_read(struct file *filp, char __user *buf, size_t count,
-			  loff_t *ppos)
+static long flifo_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
-	int value;
+	struct flifo_file *f = filp->private_data;
+	struct flifo_queue *q = f->q;
+	struct flifo_watermarks marks;
+	struct eventfd_ctx *old_ctx = NULL;
+	struct eventfd_ctx *ctx = NULL;
+	struct flifo_file *reader;
+	struct flifo_stats stats;
+	struct flifo_shard *shard;
+	long ret = 0;
+	u32 flags;
+	int old_sync;
+	int cpu;
+
+	// Called on the hot path of the mapped ring, without any lock
+	if (cmd == FLIFO_CMD_KICK) {
+		rcu_read_lock();
+		flags = xchg(&rcu_dereference(q->ring)->flags, 0);
+		rcu_read_unlock();
 
-	// The buffer is empty
-	if (nb_values == 0) {
-		// Might not be the correct code error to return but I don't see which one to use
-		return -EAGAIN;
+		if (flags & FLIFO_RING_WAIT_READ) {
+			wake_up_interruptible(&q->read_wq);
+		}
+		if (flags & FLIFO_RING_WAIT_WRITE) {
+			wake_up_interruptible(&q->write_wq);
+		}
+		flifo_check_watermarks(q);
+		return 0;
 	}
 
-	if (count != sizeof(int)) {
-		return -EINVAL;
+	// The statistics don't need the list locks either
+	if (cmd == FLIFO_CMD_GET_STATS) {
+		flifo_get_stats(q, &stats);
+		if (copy_to_user((void __user *)arg, &stats, sizeof(stats))) {
+			return -EFAULT;
+		}
+		return 0;
+	}
+	if (cmd == FLIFO_CMD_RESET_STATS) {
+		flifo_reset_stats(q);
+		return 0;
+	}
+	if (cmd == FLIFO_CMD_GET_DROPPED) {
+		if (put_user(READ_ONCE(q->dropped), (__u64 __user *)arg)) {
+			return -EFAULT;
+		}
+		return 0;
+	}
+	if (cmd == FLIFO_CMD_GET_LAG) {
+		if (put_user(READ_ONCE(f->lag), (__u64 __user *)arg)) {
+			return -EFAULT;
+		}
+		return 0;
+	}
+
+	if (cmd == FLIFO_CMD_SET_WATERMARKS &&
+	    copy_from_user(&marks, (void __user *)arg, sizeof(marks))) {
+		return -EFAULT;
+	}
+	// Take the eventfd before the locks, a negative fd detaches it
+	if (cmd == FLIFO_CMD_SET_EVENTFD && (int)arg >= 0) {
+		ctx = eventfd_ctx_fdget((int)arg);
+		if (IS_ERR(ctx)) {
+			return PTR_ERR(ctx);
+		}
 	}
 
-	switch (mode) {
-	case MODE_FIFO:
-		value = values[(NB_VALUES + next_in - nb_values) % NB_VALUES];
+	mutex_lock(&q->prod_lock);
+	mutex_lock(&q->cons_lock);
+
+	switch (cmd) {
+	case FLIFO_CMD_RESET:
+		q->ring->head = 0;
+		q->ring->tail = 0;
+		flifo_restamp(q);
+
+		list_for_each_entry(reader, &q->readers, node) {
+			WRITE_ONCE(reader->cursor, 0);
+		}
+		if (q->unbounded) {
+			flifo_clear_segments(q);
+		}
+		if (q->shards != NULL) {
+			for_each_possible_cpu(cpu) {
+				shard = per_cpu_ptr(q->shards, cpu);
+				spin_lock(&shard->lock);
+				WRITE_ONCE(shard->tail, shard->head);
+				spin_unlock(&shard->lock);
+			}
+		}
+		break;
+
+	case FLIFO_CMD_CHANGE_MODE:
+
+		if (arg != MODE_FIFO && arg != MODE_LIFO && arg != MODE_PRIO &&
+		    arg != MODE_PRIO_MIN && arg != MODE_BROADCAST) {
+			ret = -1;
+			break;
+		}
+		// A lone LIFO or priority reader would race with the producer,
+		// and the shards and segments are only FIFO
+		if (arg != MODE_FIFO && (q->sync != SYNC_MPMC || q->unbounded)) {
+			ret = -EINVAL;
+			break;
+		}
+		// The heap compares the values as ints
+		if ((arg == MODE_PRIO || arg == MODE_PRIO_MIN) &&
+		    q->elem_size != sizeof(int)) {
+			ret = -EINVAL;
+			break;
+		}
+		// There is no oldest value to drop in a heap, and the readers
+		// choose whether to drop in MODE_BROADCAST
+		if ((arg == MODE_PRIO || arg == MODE_PRIO_MIN ||
+		     arg == MODE_BROADCAST) &&
+		    q->overwrite) {
+			ret = -EINVAL;
+			break;
+		}
+		// Same for a producer in user space
+		if (arg != MODE_FIFO && atomic_read(&q->nb_maps) > 0) {
+			ret = -EBUSY;
+			break;
+		}
+		if (q->mode == arg) {
+			break;
+		}
+
+		// Turn the queued values into a heap at the start of the ring
+		if (arg == MODE_PRIO || arg == MODE_PRIO_MIN) {
+			flifo_linearize(q);
+			heap_build(q->values, q->ring->head, arg);
+		}
+		// Every reader starts with all the queued values
+		if (arg == MODE_BROADCAST) {
+			list_for_each_entry(reader, &q->readers, node) {
+				WRITE_ONCE(reader->cursor, q->ring->tail);
+			}
+		}
+
+		// The values were moved or written without stamps
+		if (q->mode != MODE_FIFO && q->mode != MODE_LIFO) {
+			flifo_restamp(q);
+		}
+
+		WRITE_ONCE(q->mode_switches, q->mode_switches + 1);
+		WRITE_ONCE(q->mode, arg);
+		if (arg == MODE_BROADCAST) {
+			flifo_bcast_update_tail(q);
+		}
+		break;
+
+	case FLIFO_CMD_CHANGE_SYNC:
+
+		if (arg != SYNC_MPMC && arg != SYNC_SPSC &&
+		    arg != SYNC_SHARDED) {
+			ret = -EINVAL;
+			break;
+		}
+		if (arg != SYNC_MPMC &&
+		    (q->mode != MODE_FIFO || q->overwrite || q->unbounded)) {
+			ret = -EINVAL;
+			break;
+		}
+		// The shards only hold ints
+		if (arg == SYNC_SHARDED && q->elem_size != sizeof(int)) {
+			ret = -EINVAL;
+			break;
+		}
+		// The shards can't be mapped
+		if (arg == SYNC_SHARDED && atomic_read(&q->nb_maps) > 0) {
+			ret = -EBUSY;
+			break;
+		}
+		old_sync = q->sync;
+
+		// The readers and writers of SYNC_SPSC don't take the locks.
+		// Close the ring to the new ones, the ones that see SYNC_MPMC
+		// wait for the locks, then check that none is left.
+		if (q->sync == SYNC_SPSC && arg != SYNC_SPSC) {
+			WRITE_ONCE(q->sync, SYNC_MPMC);
+			smp_mb();
+			if (atomic_read(&q->nb_lockless) > 0) {
+				WRITE_ONCE(q->sync, SYNC_SPSC);
+				ret = -EBUSY;
+				break;
+			}
+		}
+
+		if (arg == SYNC_SHARDED && q->sync != SYNC_SHARDED) {
+			ret = flifo_shard(q);
+		} else if (arg != SYNC_SHARDED && q->sync == SYNC_SHARDED) {
+			ret = flifo_unshard(q);
+		}
+		// Also reopens the ring to SYNC_SPSC if sharding failed
+		WRITE_ONCE(q->sync, ret == 0 ? arg : old_sync);
+		break;
+
+	case FLIFO_CMD_RESIZE:
+		ret = flifo_resize(q, arg, q->elem_size);
+		break;
+
+	case FLIFO_CMD_SET_ELEM_SIZE:
+
+		if (arg == 0 || arg > MAX_ELEM_SIZE) {
+			ret = -EINVAL;
+			break;
+		}
+		if (arg == q->elem_size) {
+			break;
+		}
+		// The heap, the shards and the segments only hold ints
+		if (q->mode == MODE_PRIO || q->mode == MODE_PRIO_MIN ||
+		    q->sync == SYNC_SHARDED || q->unbounded) {
+			ret = -EINVAL;
+			break;
+		}
+		// The queued values can't be cut to the new size
+		if (flifo_count(q) != 0) {
+			ret = -EBUSY;
+			break;
+		}
+		ret = flifo_resize(q, q->capacity, arg);
+		break;
+
+	case FLIFO_CMD_SET_OVERWRITE:
+
+		// The writers move the tail, a lone or user space consumer
+		// would race with them. The shards and segments never drop
+		// values.
+		if (arg && (q->sync != SYNC_MPMC || q->unbounded ||
+			    atomic_read(&q->nb_maps) > 0)) {
+			ret = -EBUSY;
+			break;
+		}
+		if (arg && (q->mode == MODE_PRIO || q->mode == MODE_PRIO_MIN ||
+			    q->mode == MODE_BROADCAST)) {
+			ret = -EINVAL;
+			break;
+		}
+		WRITE_ONCE(q->overwrite, arg != 0);
+		break;
+
+	case FLIFO_CMD_SET_WATERMARKS:
+
+		if (marks.high != 0 &&
+		    (marks.low >= marks.high || marks.high > q->capacity)) {
+			ret = -EINVAL;
+			break;
+		}
+		WRITE_ONCE(q->low_mark, marks.low);
+		WRITE_ONCE(q->high_mark, marks.high);
+		WRITE_ONCE(q->throttled, 0);
+		break;
+
+	case FLIFO_CMD_SET_TTL:
+		WRITE_ONCE(q->ttl_us, arg);
+		break;
+
+	case FLIFO_CMD_SET_EVENTFD:
+		old_ctx = rcu_dereference_protected(
+			q->eventfd, lockdep_is_held(&q->prod_lock));
+		rcu_assign_pointer(q->eventfd, ctx);
+		break;
+
+	case FLIFO_CMD_SET_SLOW_POLICY:
+
+		if ((arg != SLOW_BLOCK && arg != SLOW_DROP) ||
+		    !(filp->f_mode & FMODE_READ)) {
+			ret = -EINVAL;
+			break;
+		}
+		f->policy = arg;
+
+		if (q->mode == MODE_BROADCAST) {
+			// The writers may already have overtaken a dropping
+			// reader that now holds them back
+			flifo_bcast_skip(q, f);
+			flifo_bcast_update_tail(q);
+		}
 		break;
-	case MODE_LIFO:
-		value = values[(next_in - 1 + NB_VALUES) % NB_VALUES];
+
+	case FLIFO_CMD_SET_UNBOUNDED:
+
+		if (arg == 0) {
+			ret = q->unbounded ? flifo_set_bounded(q) : 0;
+			break;
+		}
+		if (q->sync != SYNC_MPMC || q->mode != MODE_FIFO ||
+		    q->overwrite || q->elem_size != sizeof(int)) {
+			ret = -EINVAL;
+			break;
+		}
+		// The segments can't be mapped
+		if (atomic_read(&q->nb_maps) > 0) {
+			ret = -EBUSY;
+			break;
+		}
+		ret = flifo_set_unbounded(q, arg);
 		break;
+
 	default:
-		return 0;
+		break;
 	}
 
-	if (copy_to_user(buf, &value, sizeof(int))) {
-		return -EFAULT;
+	mutex_unlock(&q->cons_lock);
+	mutex_unlock(&q->prod_lock);
+
+	// The whole list may be free again, or a reader stopped holding the
+	// writers
+	if (cmd == FLIFO_CMD_RESET || cmd == FLIFO_CMD_SET_SLOW_POLICY) {
+		wake_up_interruptible(&q->write_wq);
+	}
+	// The sleepers flagged themselves in the old ring header, or wait on
+	// the values or space of the other storage
+	if ((cmd == FLIFO_CMD_RESIZE || cmd == FLIFO_CMD_CHANGE_SYNC ||
+	     cmd == FLIFO_CMD_SET_UNBOUNDED || cmd == FLIFO_CMD_CHANGE_MODE ||
+	     cmd == FLIFO_CMD_SET_ELEM_SIZE) &&
+	    ret == 0) {
+		wake_up_interruptible(&q->read_wq);
+		wake_up_interruptible(&q->write_wq);
+	}
+	// Throttle right away if the list is already over the new mark, or
+	// release the pollers waiting on the old one
+	if (cmd == FLIFO_CMD_SET_WATERMARKS && ret == 0) {
+		flifo_check_watermarks(q);
+		wake_up_interruptible(&q->write_wq);
+	}
+	// Wait for the writers still signalling the old eventfd
+	if (old_ctx != NULL) {
+		synchronize_rcu();
+		eventfd_ctx_put(old_ctx);
+	}
+
+	return ret;
+}
+
+/**
+ * @brief Device file poll callback. Reports whether a read or a write would
+ *        proceed without blocking. Between the crossing of the high
+ *        watermark and the crossing of the low watermark, EPOLLPRI is
+ *        reported instead of EPOLLOUT so the producers back off before the
+ *        list is full.
+ *
+ * @param filp File structure of the char device which is polled.
+ * @param wait Poll table to which the wait queues are added.
+ *
+ * @return EPOLLIN if values can be read, EPOLLOUT if values can be written,
+ *         EPOLLPRI if the list is over its high watermark.
+ */
+static __poll_t flifo_poll(struct file *filp, poll_table *wait)
+{
+	struct flifo_file *f = filp->private_data;
+	struct flifo_queue *q = f->q;
+	__poll_t mask = 0;
+
+	poll_wait(filp, &q->read_wq, wait);
+	poll_wait(filp, &q->write_wq, wait);
+
+	if (READ_ONCE(q->mode) == MODE_BROADCAST) {
+		if (flifo_bcast_can_read(f)) {
+			mask |= EPOLLIN | EPOLLRDNORM;
+		}
+	} else if (flifo_can_read(q)) {
+		// Also flags the poller as waiting for the producers and
+		// consumers working on the mapping
+		mask |= EPOLLIN | EPOLLRDNORM;
 	}
+	// The producers working on the mapping don't check the watermarks
+	flifo_check_watermarks(q);
 
-	if (mode == MODE_LIFO) {
-		next_in--;
+	if (READ_ONCE(q->throttled)) {
+		mask |= EPOLLPRI;
+	} else if (READ_ONCE(q->overwrite) || flifo_can_write(q)) {
+		// Writers never wait in overwrite mode
+		mask |= EPOLLOUT | EPOLLWRNORM;
 	}
-	nb_values--;
 
-	*ppos += sizeof(int); // Update the cursor position
+	return mask;
+}
+
+static void flifo_vm_open(struct vm_area_struct *vma)
+{
+	struct flifo_queue *q = vma->vm_private_data;
+
+	atomic_inc(&q->nb_maps);
+}
+
+static void flifo_vm_close(struct vm_area_struct *vma)
+{
+	struct flifo_queue *q = vma->vm_private_data;
 
-	return sizeof(
-		int); // Return the number of bytes written in the userspace buffer
+	atomic_dec(&q->nb_maps);
 }
 
+static const struct vm_operations_struct flifo_vm_ops = {
+	.open = flifo_vm_open,
+	.close = flifo_vm_close,
+};
+
 /**
- * @brief Device file write callback to add a value to the list.
+ * @brief Device file mmap callback. Maps the header page of the ring
+ *        followed by the values. The list must be in FIFO mode without
+ *        overwrite, shards nor segments, and stays so as long as it is
+ *        mapped.
  *
- * @param filp  File structure of the char device to which the value is written.
- * @param buf   Userspace buffer from which the value will be copied.
- * @param count Number of available bytes in the userspace buffer.
- * @param ppos  Current cursor position in the file.
+ * @param filp File structure of the char device which is mapped.
+ * @param vma  User space area to map the ring to.
  *
- * @return Number of bytes read from the userspace buffer.
+ * @return 0 on success, a negative error code otherwise.
  */
-static ssize_t flifo_write(struct file *filp, const char __user *buf,
-			   size_t count, loff_t *ppos)
+static int flifo_mmap(struct file *filp, struct vm_area_struct *vma)
 {
-	uint32_t value;
+	struct flifo_queue *q = flifo_queue_of(filp);
+	int ret;
 
-	if (count != sizeof(uint32_t)) {
+	if (vma->vm_pgoff != 0 || !(vma->vm_flags & VM_SHARED)) {
 		return -EINVAL;
 	}
 
-	// There is no more space in the buffer
-	if (nb_values >= NB_VALUES) {
-		pr_info("Buffer full, nb_values = %d, NB_VALUES = %d\n",
-			nb_values, NB_VALUES);
-		return -ENOSPC;
+	mutex_lock(&q->prod_lock);
+	mutex_lock(&q->cons_lock);
+
+	// The helpers of flifo.h work on ints
+	if (q->mode != MODE_FIFO || q->overwrite || q->sync == SYNC_SHARDED ||
+	    q->unbounded || q->elem_size != sizeof(int)) {
+		ret = -EINVAL;
+		goto unlock;
 	}
 
-	if (copy_from_user(&value, buf, sizeof(uint32_t)) != 0) {
-		return -EFAULT;
+	// Fails if the area is larger than the ring
+	ret = remap_vmalloc_range(vma, q->ring, 0);
+	if (ret < 0) {
+		goto unlock;
 	}
 
-	values[next_in] = value;
-	next_in = (next_in + 1) % NB_VALUES;
-	nb_values++;
+	vma->vm_private_data = q;
+	vma->vm_ops = &flifo_vm_ops;
+	flifo_vm_open(vma);
+	WRITE_ONCE(q->unstamped, true);
 
-	*ppos += sizeof(uint32_t);
+unlock:
+	mutex_unlock(&q->cons_lock);
+	mutex_unlock(&q->prod_lock);
 
-	return sizeof(uint32_t);
+	return ret;
 }
 
 /**
- * @brief Device file ioctl callback. This permits to modify the behavior of the module.
- *        - If the command is FLIFO_CMD_RESET, then the list is reset.
- *        - If the command is FLIFO_CMD_CHANGE_MODE, then the arguments will determine
- *          the list's mode between FIFO (MODE_FIFO) and LIFO (MODE_LIFO)
+ * Read-only sysfs attributes of the statistics, in the "stats" directory of
+ * each device.
+ */
+#define FLIFO_STAT_ATTR(field)                                                \
+	static ssize_t field##_show(struct device *dev,                       \
+				    struct device_attribute *attr, char *buf) \
+	{                                                                     \
+		struct flifo_stats stats;                                     \
+                                                                              \
+		flifo_get_stats(dev_get_drvdata(dev), &stats);                \
+		return sysfs_emit(buf, "%llu\n",                              \
+				  (unsigned long long)stats.field);           \
+	}                                                                     \
+	static DEVICE_ATTR_RO(field)
+
+FLIFO_STAT_ATTR(enqueues);
+FLIFO_STAT_ATTR(dequeues);
+FLIFO_STAT_ATTR(full);
+FLIFO_STAT_ATTR(empty);
+FLIFO_STAT_ATTR(mode_switches);
+FLIFO_STAT_ATTR(dropped);
+FLIFO_STAT_ATTR(expired);
+FLIFO_STAT_ATTR(depth);
+FLIFO_STAT_ATTR(high_water);
+
+static struct attribute *flifo_stats_attrs[] = {
+	&dev_attr_enqueues.attr,
+	&dev_attr_dequeues.attr,
+	&dev_attr_full.attr,
+	&dev_attr_empty.attr,
+	&dev_attr_mode_switches.attr,
+	&dev_attr_dropped.attr,
+	&dev_attr_expired.attr,
+	&dev_attr_depth.attr,
+	&dev_attr_high_water.attr,
+	NULL,
+};
+
+static const struct attribute_group flifo_stats_group = {
+	.name = "stats",
+	.attrs = flifo_stats_attrs,
+};
+
+/**
+ * Number of bytes currently allocated for the values of the list.
+ */
+static ssize_t footprint_show(struct device *dev,
+			      struct device_attribute *attr, char *buf)
+{
+	return sysfs_emit(buf, "%lu\n", flifo_footprint(dev_get_drvdata(dev)));
+}
+static DEVICE_ATTR_RO(footprint);
+
+static struct attribute *flifo_attrs[] = {
+	&dev_attr_footprint.attr,
+	NULL,
+};
+
+static const struct attribute_group flifo_group = {
+	.attrs = flifo_attrs,
+};
+
+static const struct attribute_group *flifo_groups[] = {
+	&flifo_group,
+	&flifo_stats_group,
+	NULL,
+};
+
+static struct dentry *flifo_debugfs;
+
+/**
+ * Enqueue-to-dequeue latency histogram of a list, in debugfs. Each line
+ * gives the range of a log2 bucket in ns and its number of values.
+ */
+static int flifo_latency_show(struct seq_file *m, void *v)
+{
+	struct flifo_queue *q = m->private;
+	u64 count;
+	int bucket;
+	int cpu;
+
+	for (bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+		count = 0;
+		for_each_possible_cpu(cpu) {
+			count += READ_ONCE(
+				per_cpu_ptr(q->stats, cpu)->latency[bucket]);
+		}
+		if (count == 0) {
+			continue;
+		}
+
+		if (bucket == LATENCY_BUCKETS - 1) {
+			seq_printf(m, "%llu+: %llu\n", 1ULL << (bucket - 1),
+				   count);
+		} else {
+			seq_printf(m, "%llu-%llu: %llu\n",
+				   bucket ? 1ULL << (bucket - 1) : 0,
+				   (1ULL << bucket) - 1, count);
+		}
+	}
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(flifo_latency);
+
+/**
+ * @brief Device file open callback, selects the list of the minor. A file
+ *        open for reading gets a cursor at the current head, so in
+ *        MODE_BROADCAST it reads the values written from now on.
  *
- * @param filp File structure of the char device to which ioctl is performed.
- * @param cmd  Command value of the ioctl
- * @param arg  Optionnal argument of the ioctl
+ * @param inode Inode of the device file.
+ * @param filp  File structure of the char device being opened.
  *
- * @return 0 if ioctl succeed, -1 otherwise.
+ * @return 0, or -ENOMEM if the state of the file can't be allocated.
  */
-static long flifo_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+static int flifo_open(struct inode *inode, struct file *filp)
 {
-	switch (cmd) {
-	case FLIFO_CMD_RESET:
-		next_in = 0;
-		nb_values = 0;
+	struct flifo_queue *q = &queues[iminor(inode)];
+	struct flifo_file *f;
 
-		break;
+	f = kzalloc(sizeof(*f), GFP_KERNEL);
+	if (f == NULL) {
+		return -ENOMEM;
+	}
+	f->q = q;
+	f->policy = SLOW_BLOCK;
+	INIT_LIST_HEAD(&f->node);
+	filp->private_data = f;
 
-	case FLIFO_CMD_CHANGE_MODE:
+	if (filp->f_mode & FMODE_READ) {
+		mutex_lock(&q->prod_lock);
+		mutex_lock(&q->cons_lock);
+		f->cursor = q->ring->head;
+		list_add_tail(&f->node, &q->readers);
+		mutex_unlock(&q->cons_lock);
+		mutex_unlock(&q->prod_lock);
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Device file fasync callback, (un)registers the file for SIGIO.
+ *
+ * @param fd   File descriptor in user space.
+ * @param filp File structure of the char device.
+ * @param on   Whether to register or unregister.
+ *
+ * @return A negative error code on failure.
+ */
+static int flifo_fasync(int fd, struct file *filp, int on)
+{
+	struct flifo_queue *q = flifo_queue_of(filp);
+
+	return fasync_helper(fd, filp, on, &q->fasync);
+}
+
+/**
+ * @brief Device file release callback, stops signaling the file and
+ *        releases the writers it held back in MODE_BROADCAST.
+ *
+ * @param inode Inode of the device file.
+ * @param filp  File structure of the char device being closed.
+ *
+ * @return 0
+ */
+static int flifo_release(struct inode *inode, struct file *filp)
+{
+	struct flifo_file *f = filp->private_data;
+	struct flifo_queue *q = f->q;
+
+	flifo_fasync(-1, filp, 0);
 
-		if (arg != MODE_FIFO && arg != MODE_LIFO) {
-			return -1;
+	if (!list_empty(&f->node)) {
+		mutex_lock(&q->prod_lock);
+		mutex_lock(&q->cons_lock);
+		list_del(&f->node);
+		if (q->mode == MODE_BROADCAST) {
+			flifo_bcast_update_tail(q);
 		}
-		mode = arg;
-		break;
+		mutex_unlock(&q->cons_lock);
+		mutex_unlock(&q->prod_lock);
 
-	default:
-		break;
+		wake_up_interruptible(&q->write_wq);
 	}
 
+	kfree(f);
 	return 0;
 }
 
@@ -160,16 +3033,121 @@ static int flifo_uevent(struct device *dev, struct kobj_uevent_env *env)
 
 const static struct file_operations flifo_fops = {
 	.owner = THIS_MODULE,
-	.read = flifo_read,
-	.write = flifo_write,
+	.open = flifo_open,
+	.release = flifo_release,
+	.read_iter = flifo_read_iter,
+	.write_iter = flifo_write_iter,
+	.splice_read = generic_file_splice_read,
+	.splice_write = iter_file_splice_write,
 	.unlocked_ioctl = flifo_ioctl,
+	.poll = flifo_poll,
+	.mmap = flifo_mmap,
+	.fasync = flifo_fasync,
 };
 
+/**
+ * @brief Initialise an empty list in FIFO mode.
+ *
+ * @param q The list to initialise.
+ *
+ * @return 0 on success, -ENOMEM if the ring can't be allocated.
+ */
+static int flifo_queue_init(struct flifo_queue *q)
+{
+	q->capacity = roundup_pow_of_two(capacity);
+	q->elem_size = elem_size;
+	q->ring = flifo_alloc_ring(q->capacity, q->elem_size);
+	if (q->ring == NULL) {
+		return -ENOMEM;
+	}
+	q->values = RING_VALUES(q->ring);
+	if (timestamps) {
+		q->stamps = vmalloc(q->capacity * sizeof(u64));
+		if (q->stamps == NULL) {
+			return -ENOMEM;
+		}
+	}
+	q->ttl_us = 0;
+	q->unstamped = false;
+	q->stats = alloc_percpu(struct flifo_pcpu_stats);
+	if (q->stats == NULL) {
+		return -ENOMEM;
+	}
+	atomic_set(&q->nb_maps, 0);
+	q->mode = MODE_FIFO;
+	q->overwrite = false;
+	q->low_mark = 0;
+	q->high_mark = 0;
+	q->throttled = 0;
+	q->fasync = NULL;
+	RCU_INIT_POINTER(q->eventfd, NULL);
+	q->sync = SYNC_MPMC;
+	q->shards = NULL;
+	q->shard_capacity = 0;
+	q->unbounded = false;
+	INIT_LIST_HEAD(&q->segments);
+	INIT_LIST_HEAD(&q->free_segments);
+	q->nb_segments = 0;
+	q->nb_free_segments = 0;
+	q->nb_seg_values = 0;
+	q->memory_limit = 0;
+	INIT_LIST_HEAD(&q->readers);
+	mutex_init(&q->prod_lock);
+	mutex_init(&q->cons_lock);
+	init_waitqueue_head(&q->read_wq);
+	init_waitqueue_head(&q->write_wq);
+
+	return 0;
+}
+
+static void flifo_queue_destroy(struct flifo_queue *q)
+{
+	if (q->shards != NULL) {
+		flifo_free_shards(q->shards);
+	}
+	// Only an unbounded list has segments, and its lists are initialised
+	if (q->unbounded) {
+		flifo_free_segments(q);
+	}
+	if (rcu_access_pointer(q->eventfd) != NULL) {
+		eventfd_ctx_put(rcu_dereference_protected(q->eventfd, true));
+	}
+	free_percpu(q->stats);
+	vfree(q->stamps);
+	vfree(q->ring);
+}
+
 static int __init flifo_init(void)
 {
-	next_in = 0;
-	nb_values = 0;
-	mode = MODE_FIFO;
+	unsigned int i;
+	int err;
+
+	if (capacity == 0 || capacity > MAX_CAPACITY) {
+		pr_err("Invalid capacity %u\n", capacity);
+		return -EINVAL;
+	}
+	if (elem_size == 0 || elem_size > MAX_ELEM_SIZE ||
+	    (u64)roundup_pow_of_two(capacity) * elem_size > MAX_RING_SIZE) {
+		pr_err("Invalid value size %u\n", elem_size);
+		return -EINVAL;
+	}
+	if (nb_devices == 0 || nb_devices > MAX_DEVICES) {
+		pr_err("Invalid number of devices %u\n", nb_devices);
+		return -EINVAL;
+	}
+
+	queues = kcalloc(nb_devices, sizeof(*queues), GFP_KERNEL);
+	if (queues == NULL) {
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < nb_devices; i++) {
+		err = flifo_queue_init(&queues[i]);
+		if (err < 0) {
+			pr_err("Can't allocate the list\n");
+			goto free_queues;
+		}
+	}
 
 	// Old way to register a char device
 	//register_chrdev(MAJOR_NUM, DEVICE_NAME, &flifo_fops);
@@ -177,67 +3155,125 @@ static int __init flifo_init(void)
 	// New way to register a char device
 	dev_num = MKDEV(MAJOR_NUM, 0);
 
-	// Register the char device
-	if (register_chrdev_region(dev_num, 1, DEVICE_NAME) < 0) {
+	// Register the char device, one minor per list
+	err = register_chrdev_region(dev_num, nb_devices, DEVICE_NAME);
+	if (err < 0) {
 		pr_err("Can't register device\n");
-		return -1;
+		goto free_queues;
 	}
 
 	// Create a class for the device
 	my_class = class_create(THIS_MODULE, DEVICE_NAME);
-	if (my_class == NULL) {
+	if (IS_ERR(my_class)) {
 		pr_err("Can't create class\n");
+		err = PTR_ERR(my_class);
 		goto unregister;
 	}
 
 	// Set the permissions of the device file
 	my_class->dev_uevent = flifo_uevent;
 
-	// Create the device file
-	if (device_create(my_class, NULL, dev_num, NULL, DEVICE_NAME) == NULL) {
-		pr_err("Can't create device\n");
-
-		goto class_destroy;
-	}
-
 	// Initialize the char device
 	cdev_init(&flifo_cdev, &flifo_fops);
 
 	// Add the char device
-	if (cdev_add(&flifo_cdev, dev_num, 1) < 0) {
+	err = cdev_add(&flifo_cdev, dev_num, nb_devices);
+	if (err < 0) {
 		pr_err("Can't add cdev\n");
-		goto device_destroy;
+		goto class_destroy;
+	}
+
+	// Create the device files
+	for (i = 0; i < nb_devices; i++) {
+		struct device *dev;
+
+		dev = device_create_with_groups(my_class, NULL,
+						MKDEV(MAJOR_NUM, i), &queues[i],
+						flifo_groups, DEVICE_NAME "%u",
+						i);
+		if (IS_ERR(dev)) {
+			pr_err("Can't create device\n");
+			err = PTR_ERR(dev);
+			goto device_destroy;
+		}
 	}
 
 	pr_info("FLIFO ready!\n");
 	pr_info("ioctl FLIFO_CMD_RESET: %u\n", FLIFO_CMD_RESET);
 	pr_info("ioctl FLIFO_CMD_CHANGE_MODE: %lu\n", FLIFO_CMD_CHANGE_MODE);
-	pr_info(KERN_INFO
-		"FLIFO device initialized with major %d and minor %d\n",
-		MAJOR(dev_num), MINOR(dev_num));
+	pr_info("ioctl FLIFO_CMD_CHANGE_SYNC: %lu\n", FLIFO_CMD_CHANGE_SYNC);
+	pr_info("ioctl FLIFO_CMD_KICK: %u\n", FLIFO_CMD_KICK);
+	pr_info("ioctl FLIFO_CMD_RESIZE: %lu\n", FLIFO_CMD_RESIZE);
+	pr_info("ioctl FLIFO_CMD_GET_STATS: %lu\n", FLIFO_CMD_GET_STATS);
+	pr_info("ioctl FLIFO_CMD_RESET_STATS: %u\n", FLIFO_CMD_RESET_STATS);
+	pr_info("ioctl FLIFO_CMD_SET_OVERWRITE: %lu\n", FLIFO_CMD_SET_OVERWRITE);
+	pr_info("ioctl FLIFO_CMD_GET_DROPPED: %lu\n", FLIFO_CMD_GET_DROPPED);
+	pr_info("ioctl FLIFO_CMD_SET_WATERMARKS: %lu\n",
+		FLIFO_CMD_SET_WATERMARKS);
+	pr_info("ioctl FLIFO_CMD_SET_UNBOUNDED: %lu\n", FLIFO_CMD_SET_UNBOUNDED);
+	pr_info("ioctl FLIFO_CMD_SET_SLOW_POLICY: %lu\n",
+		FLIFO_CMD_SET_SLOW_POLICY);
+	pr_info("ioctl FLIFO_CMD_GET_LAG: %lu\n", FLIFO_CMD_GET_LAG);
+	pr_info("ioctl FLIFO_CMD_SET_TTL: %lu\n", FLIFO_CMD_SET_TTL);
+	pr_info("ioctl FLIFO_CMD_SET_ELEM_SIZE: %lu\n", FLIFO_CMD_SET_ELEM_SIZE);
+	pr_info("ioctl FLIFO_CMD_SET_EVENTFD: %lu\n", FLIFO_CMD_SET_EVENTFD);
+	// The latency histograms are only for debugging, failures are ignored
+	flifo_debugfs = debugfs_create_dir(DEVICE_NAME, NULL);
+	for (i = 0; i < nb_devices; i++) {
+		char name[16];
+
+		snprintf(name, sizeof(name), DEVICE_NAME "%u", i);
+		debugfs_create_file("latency", 0444,
+				    debugfs_create_dir(name, flifo_debugfs),
+				    &queues[i], &flifo_latency_fops);
+	}
+
+	pr_info("FLIFO device initialized with major %d and %u minor(s)\n",
+		MAJOR(dev_num), nb_devices);
 	return 0;
 
 device_destroy:
-	device_destroy(my_class, dev_num);
+	while (i--) {
+		device_destroy(my_class, MKDEV(MAJOR_NUM, i));
+	}
+	cdev_del(&flifo_cdev);
 
 class_destroy:
 	class_destroy(my_class);
 
 unregister:
-	unregister_chrdev(MAJOR_NUM, DEVICE_NAME);
+	unregister_chrdev_region(dev_num, nb_devices);
+
+free_queues:
+	// The lists are zeroed, the ones not initialised are freed safely
+	for (i = 0; i < nb_devices; i++) {
+		flifo_queue_destroy(&queues[i]);
+	}
+	kfree(queues);
 
-	return -1;
+	return err;
 }
 
 static void __exit flifo_exit(void)
 {
+	unsigned int i;
+
 	// Old way to unregister a char device
 	//unregister_chrdev(MAJOR_NUM, DEVICE_NAME);
 
+	debugfs_remove_recursive(flifo_debugfs);
+
+	for (i = 0; i < nb_devices; i++) {
+		device_destroy(my_class, MKDEV(MAJOR_NUM, i));
+	}
 	cdev_del(&flifo_cdev);
-	device_destroy(my_class, dev_num);
 	class_destroy(my_class);
-	unregister_chrdev_region(dev_num, 1);
+	unregister_chrdev_region(dev_num, nb_devices);
+
+	for (i = 0; i < nb_devices; i++) {
+		flifo_queue_destroy(&queues[i]);
+	}
+	kfree(queues);
 
 	pr_info("FLIFO done!\n");
 }
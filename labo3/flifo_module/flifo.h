@@ -5,16 +5,266 @@
 #include <linux/ioctl.h>
 #else
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <string.h>
+#include <unistd.h>
 #endif
+#include <linux/types.h>
 
 #define FLIFO_IOC_MAGIC       '+'
 
 #define FLIFO_CMD_RESET       _IO(FLIFO_IOC_MAGIC, 0)
 #define FLIFO_CMD_CHANGE_MODE _IOW(FLIFO_IOC_MAGIC, 1, int)
+#define FLIFO_CMD_CHANGE_SYNC _IOW(FLIFO_IOC_MAGIC, 2, int)
+#define FLIFO_CMD_KICK	      _IO(FLIFO_IOC_MAGIC, 3)
+#define FLIFO_CMD_RESIZE      _IOW(FLIFO_IOC_MAGIC, 4, int)
+#define FLIFO_CMD_GET_STATS   _IOR(FLIFO_IOC_MAGIC, 5, struct flifo_stats)
+#define FLIFO_CMD_RESET_STATS _IO(FLIFO_IOC_MAGIC, 6)
+#define FLIFO_CMD_SET_OVERWRITE _IOW(FLIFO_IOC_MAGIC, 7, int)
+#define FLIFO_CMD_GET_DROPPED _IOR(FLIFO_IOC_MAGIC, 8, __u64)
+#define FLIFO_CMD_SET_WATERMARKS \
+	_IOW(FLIFO_IOC_MAGIC, 9, struct flifo_watermarks)
+#define FLIFO_CMD_SET_UNBOUNDED _IOW(FLIFO_IOC_MAGIC, 10, unsigned long)
+#define FLIFO_CMD_SET_SLOW_POLICY _IOW(FLIFO_IOC_MAGIC, 11, int)
+#define FLIFO_CMD_GET_LAG     _IOR(FLIFO_IOC_MAGIC, 12, __u64)
+#define FLIFO_CMD_SET_TTL     _IOW(FLIFO_IOC_MAGIC, 13, unsigned long)
+#define FLIFO_CMD_SET_ELEM_SIZE _IOW(FLIFO_IOC_MAGIC, 14, int)
+// Signal an eventfd when values arrive in an empty list, -1 to detach it
+#define FLIFO_CMD_SET_EVENTFD _IOW(FLIFO_IOC_MAGIC, 15, int)
 
 #define MODE_FIFO	      0
 #define MODE_LIFO	      1
+#define MODE_PRIO	      2
+#define MODE_PRIO_MIN	      3
+#define MODE_BROADCAST	      4
 
+#define SYNC_MPMC	      0
+#define SYNC_SPSC	      1
+#define SYNC_SHARDED	      2
+
+// What happens to a reader slower than the writers in MODE_BROADCAST
+#define SLOW_BLOCK	      0
+#define SLOW_DROP	      1
+
+// Default capacity, see the capacity module parameter and FLIFO_CMD_RESIZE
 #define NB_VALUES   16
 
+/**
+ * struct flifo_stats - Statistics of a list, see FLIFO_CMD_GET_STATS
+ * @enqueues:	   Values written with write().
+ * @dequeues:	   Values read with read().
+ * @full:	   Writes rejected with -ENOSPC.
+ * @empty:	   Reads rejected with -EAGAIN.
+ * @mode_switches: Changes of mode.
+ * @dropped:	   Values dropped by the writers in overwrite mode.
+ * @expired:	   Values dropped by the readers because they were older
+ *		   than the TTL.
+ * @depth:	   Number of values currently in the list.
+ * @high_water:	   Highest number of values seen in the list.
+ *
+ * The values moved through the mapped ring are not counted. The high-water
+ * mark is not updated in SYNC_SHARDED. Only the ring in FIFO and LIFO
+ * modes stamps its values, for the TTL and the latency histogram in
+ * debugfs (flifo/flifoN/latency).
+ */
+struct flifo_stats {
+	__u64 enqueues;
+	__u64 dequeues;
+	__u64 full;
+	__u64 empty;
+	__u64 mode_switches;
+	__u64 dropped;
+	__u64 expired;
+	__u32 depth;
+	__u32 high_water;
+};
+
+/**
+ * struct flifo_watermarks - Backpressure thresholds of a list
+ * @low:  Depth at or under which the producers are released.
+ * @high: Depth at or above which POLLPRI and SIGIO (POLL_PRI) are raised,
+ *	  0 to disable the watermarks.
+ */
+struct flifo_watermarks {
+	__u32 low;
+	__u32 high;
+};
+
+// Set in flifo_ring.flags while a task sleeps waiting for values or space
+#define FLIFO_RING_WAIT_READ  (1 << 0)
+#define FLIFO_RING_WAIT_WRITE (1 << 1)
+
+/**
+ * struct flifo_ring - Header page of the ring shared through mmap
+ * @head:	 Free-running index of the next value to write.
+ * @tail:	 Free-running index of the oldest value.
+ * @flags:	 FLIFO_RING_WAIT_* flags set by the driver.
+ * @capacity:	 Number of values in the ring, a power of 2.
+ * @data_offset: Offset of the values from the start of the mapping.
+ *
+ * The mapping follows the single-producer/single-consumer protocol of
+ * SYNC_SPSC in FIFO mode: the producer fills the slots from head and then
+ * publishes head with a release store, the consumer reads the slots from
+ * tail and then releases them by storing tail. Each index sits on its own
+ * cache line so the two sides do not bounce the same line.
+ */
+struct flifo_ring {
+	__u32 head __attribute__((aligned(64)));
+	__u32 tail __attribute__((aligned(64)));
+	__u32 flags __attribute__((aligned(64)));
+	__u32 capacity;
+	__u32 data_offset;
+};
+
+#ifndef __KERNEL__
+
+/**
+ * struct flifo_map - User space view of a mapped ring
+ * @fd:	    File descriptor of the device.
+ * @ring:   Header of the ring.
+ * @values: Values of the ring.
+ * @size:   Size of the mapping.
+ */
+struct flifo_map {
+	int fd;
+	struct flifo_ring *ring;
+	int *values;
+	size_t size;
+};
+
+/**
+ * @brief Map the ring of the device. The list must be in FIFO mode, with
+ *        values of sizeof(int) bytes.
+ * @param fd File descriptor of the device, opened with O_RDWR.
+ * @param map Mapping to initialise.
+ * @return 0 on success, -1 otherwise (errno is set).
+*/
+static inline int flifo_map(int fd, struct flifo_map *map)
+{
+	long page_size = sysconf(_SC_PAGESIZE);
+	struct flifo_ring *ring;
+
+	// Map the header alone first to learn the size of the ring
+	ring = mmap(NULL, page_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (ring == MAP_FAILED) {
+		return -1;
+	}
+	map->size = ring->data_offset + ring->capacity * sizeof(int);
+	munmap(ring, page_size);
+
+	ring = mmap(NULL, map->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+		    0);
+	if (ring == MAP_FAILED) {
+		return -1;
+	}
+
+	map->fd = fd;
+	map->ring = ring;
+	map->values = (int *)((char *)ring + ring->data_offset);
+	return 0;
+}
+
+/**
+ * @brief Unmap a ring mapped with flifo_map.
+ * @param map Mapping to release.
+*/
+static inline void flifo_unmap(struct flifo_map *map)
+{
+	munmap(map->ring, map->size);
+	map->ring = NULL;
+	map->values = NULL;
+}
+
+/**
+ * @brief Wake up the tasks sleeping in the driver if the given flag says
+ *        that there are some. The fence orders the index update before the
+ *        flag check, and pairs with the driver setting the flag before
+ *        checking the index.
+*/
+static inline void flifo_map_kick(struct flifo_map *map, __u32 flag)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&map->ring->flags, __ATOMIC_RELAXED) & flag) {
+		ioctl(map->fd, FLIFO_CMD_KICK);
+	}
+}
+
+/**
+ * @brief Push values into a mapped ring, only entering the kernel if a
+ *        reader sleeps on the device.
+ * @param map Mapping of the ring.
+ * @param values Values to push.
+ * @param n Number of values to push.
+ * @return Number of values actually pushed, 0 if the ring is full.
+*/
+static inline unsigned int flifo_map_push(struct flifo_map *map,
+					  const int *values, unsigned int n)
+{
+	struct flifo_ring *ring = map->ring;
+	__u32 mask = ring->capacity - 1;
+	__u32 head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+	__u32 tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	__u32 free = ring->capacity - (head - tail);
+	__u32 first;
+
+	if (n > free) {
+		n = free;
+	}
+	if (n == 0) {
+		return 0;
+	}
+
+	first = ring->capacity - (head & mask);
+	if (first > n) {
+		first = n;
+	}
+	memcpy(&map->values[head & mask], values, first * sizeof(int));
+	memcpy(map->values, values + first, (n - first) * sizeof(int));
+
+	__atomic_store_n(&ring->head, head + n, __ATOMIC_RELEASE);
+	flifo_map_kick(map, FLIFO_RING_WAIT_READ);
+
+	return n;
+}
+
+/**
+ * @brief Pop values from a mapped ring, only entering the kernel if a
+ *        writer sleeps on the device.
+ * @param map Mapping of the ring.
+ * @param values Array to store the values.
+ * @param n Maximum number of values to pop.
+ * @return Number of values actually popped, 0 if the ring is empty.
+*/
+static inline unsigned int flifo_map_pop(struct flifo_map *map, int *values,
+					 unsigned int n)
+{
+	struct flifo_ring *ring = map->ring;
+	__u32 mask = ring->capacity - 1;
+	__u32 tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+	__u32 head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	__u32 used = head - tail;
+	__u32 first;
+
+	if (n > used) {
+		n = used;
+	}
+	if (n == 0) {
+		return 0;
+	}
+
+	first = ring->capacity - (tail & mask);
+	if (first > n) {
+		first = n;
+	}
+	memcpy(values, &map->values[tail & mask], first * sizeof(int));
+	memcpy(values + first, map->values, (n - first) * sizeof(int));
+
+	__atomic_store_n(&ring->tail, tail + n, __ATOMIC_RELEASE);
+	flifo_map_kick(map, FLIFO_RING_WAIT_WRITE);
+
+	return n;
+}
+
+#endif /* __KERNEL__ */
+
 #endif /* FLIFO_H */
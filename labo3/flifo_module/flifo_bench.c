@@ -0,0 +1,195 @@
+/**
+* @file flifo_bench.c
+* @brief Benchmark of libflifo. Producer threads push batches of values
+*        with flifo_push_n while the main thread pops them with
+*        flifo_pop_n. For each thread count and batch size it prints the
+*        throughput and the median and 99th percentile latency of a push.
+*        A single producer goes through the mapped ring, several ones
+*        through the syscalls.
+*
+*        Usage: flifo_bench [max_threads] [device]
+*/
+#include <stdio.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include "libflifo.h"
+
+#define DEVICE_PATH	   "/dev/flifo0"
+
+#define VALUES_PER_THREAD  (1 << 17)
+#define MAX_THREADS	   16
+#define MAX_BATCH	   256
+#define BENCH_CAPACITY	   1024
+
+static const int batch_sizes[] = { 1, 4, 16, 64, MAX_BATCH };
+
+static const char *path = DEVICE_PATH;
+
+/**
+ * struct producer - State of a producer thread
+ * @dev:       Handle of the thread.
+ * @batch:     Number of values per push.
+ * @latencies: Duration of each push in ns, VALUES_PER_THREAD / @batch.
+ */
+struct producer {
+	struct flifo_dev *dev;
+	int batch;
+	long *latencies;
+};
+
+static long elapsedNs(const struct timespec *start,
+		      const struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) * 1000000000L +
+	       (end->tv_nsec - start->tv_nsec);
+}
+
+static int compareLong(const void *a, const void *b)
+{
+	long x = *(const long *)a;
+	long y = *(const long *)b;
+
+	return (x > y) - (x < y);
+}
+
+/**
+ * @brief Producer thread, pushes VALUES_PER_THREAD values by batches and
+ *        times each push.
+ * @param arg The struct producer of the thread.
+*/
+static void *producer(void *arg)
+{
+	struct producer *p = arg;
+	int values[MAX_BATCH] = { 0 };
+	struct timespec start, end;
+
+	for (int i = 0; i < VALUES_PER_THREAD / p->batch; i++) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		if (flifo_push_n(p->dev, values, p->batch) != p->batch) {
+			perror("flifo_push_n");
+			exit(EXIT_FAILURE);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		p->latencies[i] = elapsedNs(&start, &end);
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief Run nb_threads producers pushing batches of batch values against
+ *        one consumer and print the results.
+ * @param ctl Handle used to configure the list.
+ * @param nb_threads Number of producer threads.
+ * @param batch Number of values per push.
+*/
+static void run(struct flifo_dev *ctl, int nb_threads, int batch)
+{
+	// The mapped ring needs a single producer and a single consumer
+	unsigned int options = nb_threads == 1 ? FLIFO_OPT_SPSC : 0;
+	int sync = nb_threads == 1 ? SYNC_SPSC : SYNC_MPMC;
+	int nb_calls = VALUES_PER_THREAD / batch;
+	long nb_latencies = (long)nb_threads * nb_calls;
+	struct producer producers[MAX_THREADS];
+	pthread_t threads[MAX_THREADS];
+	static int values[BENCH_CAPACITY];
+	struct flifo_dev *consumer;
+	struct timespec start, end;
+	long *latencies;
+	int mapped;
+
+	if (flifo_reset(ctl) < 0 ||
+	    ioctl(flifo_fd(ctl), FLIFO_CMD_CHANGE_SYNC, sync) < 0) {
+		perror("ioctl");
+		exit(EXIT_FAILURE);
+	}
+
+	latencies = malloc(nb_latencies * sizeof(long));
+	consumer = flifo_open(path, O_RDWR, options);
+	if (latencies == NULL || consumer == NULL) {
+		perror("setup");
+		exit(EXIT_FAILURE);
+	}
+	for (int i = 0; i < nb_threads; i++) {
+		producers[i].dev = flifo_open(path, O_RDWR, options);
+		producers[i].batch = batch;
+		producers[i].latencies = latencies + (long)i * nb_calls;
+		if (producers[i].dev == NULL) {
+			perror("flifo_open");
+			exit(EXIT_FAILURE);
+		}
+	}
+	mapped = flifo_is_mapped(producers[0].dev);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i = 0; i < nb_threads; i++) {
+		pthread_create(&threads[i], NULL, producer, &producers[i]);
+	}
+	for (long received = 0; received < nb_latencies * batch;) {
+		ssize_t err = flifo_pop_n(consumer, values, BENCH_CAPACITY);
+		if (err < 0) {
+			perror("flifo_pop_n");
+			exit(EXIT_FAILURE);
+		}
+		received += err;
+	}
+	for (int i = 0; i < nb_threads; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	for (int i = 0; i < nb_threads; i++) {
+		flifo_close(producers[i].dev);
+	}
+	flifo_close(consumer);
+
+	qsort(latencies, nb_latencies, sizeof(long), compareLong);
+	printf("%2d thread(s), batch %3d, %s: %11.0f values/s, "
+	       "p50 %7ld ns, p99 %7ld ns\n",
+	       nb_threads, batch, mapped ? "mapped " : "syscall",
+	       nb_latencies * batch / (elapsedNs(&start, &end) / 1e9),
+	       latencies[nb_latencies / 2], latencies[nb_latencies * 99 / 100]);
+	free(latencies);
+
+	ioctl(flifo_fd(ctl), FLIFO_CMD_CHANGE_SYNC, SYNC_MPMC);
+}
+
+int main(int argc, char *argv[])
+{
+	int max_threads = argc > 1 ? atoi(argv[1]) : MAX_THREADS;
+	struct flifo_dev *ctl;
+
+	if (max_threads < 1 || max_threads > MAX_THREADS) {
+		max_threads = MAX_THREADS;
+	}
+	if (argc > 2) {
+		path = argv[2];
+	}
+
+	ctl = flifo_open(path, O_RDWR, 0);
+	if (ctl == NULL) {
+		perror("flifo_open");
+		exit(EXIT_FAILURE);
+	}
+
+	if (flifo_set_mode(ctl, MODE_FIFO) < 0 ||
+	    ioctl(flifo_fd(ctl), FLIFO_CMD_RESIZE, BENCH_CAPACITY) < 0) {
+		perror("ioctl");
+		exit(EXIT_FAILURE);
+	}
+
+	for (int threads = 1; threads <= max_threads; threads *= 2) {
+		for (size_t i = 0;
+		     i < sizeof(batch_sizes) / sizeof(batch_sizes[0]); i++) {
+			run(ctl, threads, batch_sizes[i]);
+		}
+	}
+
+	ioctl(flifo_fd(ctl), FLIFO_CMD_RESIZE, NB_VALUES);
+	flifo_reset(ctl);
+	flifo_close(ctl);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,240 @@
+#ifndef FLIFO_CORE_H
+#define FLIFO_CORE_H
+
+/*
+ * Ring, heap and index logic of the flifo driver. It takes no lock,
+ * allocates nothing and never touches user space, so the KUnit suite
+ * (flifo_kunit.c) runs it as is.
+ *
+ * The indices of a ring are free-running and masked with capacity - 1, the
+ * capacity being a power of 2. A ring of esz-byte values starts at values.
+ */
+
+#include <linux/kernel.h> /* Needed for min_t */
+#include <linux/types.h>
+#include <linux/string.h> /* Needed for memcpy */
+#include <linux/bitops.h> /* Needed for fls64 */
+
+#include "flifo.h"
+
+/**
+ * @brief Number of values between tail and head, at most capacity since the
+ *        indices can be scribbled on through the mapping.
+ */
+static inline u32 ring_used(u32 head, u32 tail, u32 capacity)
+{
+	return min_t(u32, head - tail, capacity);
+}
+
+/**
+ * @brief Number of values out of n that fit from index to the end of the
+ *        ring, the rest wrapping around to its start.
+ */
+static inline u32 ring_contiguous(u32 index, u32 n, u32 capacity)
+{
+	return min_t(u32, n, capacity - (index & (capacity - 1)));
+}
+
+/**
+ * @brief Address of the value at a free-running index of a ring.
+ */
+static inline void *ring_slot(void *values, u32 esz, u32 capacity,
+			      u32 index)
+{
+	return (char *)values + (size_t)(index & (capacity - 1)) * esz;
+}
+
+/**
+ * @brief Copy n values of a ring from index tail on, in order, in at most
+ *        two chunks.
+ */
+static inline void ring_read(void *values, u32 esz, u32 capacity, u32 tail,
+			     void *buf, u32 n)
+{
+	u32 first = ring_contiguous(tail, n, capacity);
+
+	memcpy(buf, ring_slot(values, esz, capacity, tail), first * esz);
+	memcpy((char *)buf + first * esz, values, (n - first) * esz);
+}
+
+/**
+ * @brief Copy n values to a ring from index head on, in at most two chunks.
+ */
+static inline void ring_write(void *values, u32 esz, u32 capacity, u32 head,
+			      const void *buf, u32 n)
+{
+	u32 first = ring_contiguous(head, n, capacity);
+
+	memcpy(ring_slot(values, esz, capacity, head), buf, first * esz);
+	memcpy(values, (const char *)buf + first * esz, (n - first) * esz);
+}
+
+/**
+ * @brief Copy n values of a ring to buf, newest first, starting before the
+ *        free-running index head. The common sizes are moved with plain
+ *        loads and stores, only the records go through memcpy.
+ */
+static inline void ring_gather_lifo(void *values, u32 esz, u32 capacity,
+				    void *buf, u32 head, u32 n)
+{
+	u32 mask = capacity - 1;
+	u32 i;
+
+	switch (esz) {
+	case sizeof(u8):
+		for (i = 0; i < n; i++) {
+			((u8 *)buf)[i] = ((u8 *)values)[(head - 1 - i) & mask];
+		}
+		break;
+	case sizeof(u16):
+		for (i = 0; i < n; i++) {
+			((u16 *)buf)[i] =
+				((u16 *)values)[(head - 1 - i) & mask];
+		}
+		break;
+	case sizeof(u32):
+		for (i = 0; i < n; i++) {
+			((u32 *)buf)[i] =
+				((u32 *)values)[(head - 1 - i) & mask];
+		}
+		break;
+	case sizeof(u64):
+		for (i = 0; i < n; i++) {
+			((u64 *)buf)[i] =
+				((u64 *)values)[(head - 1 - i) & mask];
+		}
+		break;
+	default:
+		for (i = 0; i < n; i++) {
+			memcpy((char *)buf + i * esz,
+			       ring_slot(values, esz, capacity, head - 1 - i),
+			       esz);
+		}
+		break;
+	}
+}
+
+static inline void ring_reverse(int *values, u32 from, u32 to)
+{
+	int tmp;
+
+	while (from + 1 < to) {
+		to--;
+		tmp = values[from];
+		values[from] = values[to];
+		values[to] = tmp;
+		from++;
+	}
+}
+
+/**
+ * @brief Rotate the ring in place so that the value at index start ends up
+ *        at index 0, keeping the order of the values.
+ */
+static inline void ring_rotate(int *values, u32 capacity, u32 start)
+{
+	ring_reverse(values, 0, start);
+	ring_reverse(values, start, capacity);
+	ring_reverse(values, 0, capacity);
+}
+
+/**
+ * @brief Whether a should be read before b in a priority mode.
+ */
+static inline bool heap_before(int mode, int a, int b)
+{
+	return mode == MODE_PRIO ? a > b : a < b;
+}
+
+/**
+ * @brief Move the value at index i of the heap up to its place.
+ */
+static inline void heap_sift_up(int *heap, u32 i, int mode)
+{
+	int value = heap[i];
+	u32 parent;
+
+	while (i > 0) {
+		parent = (i - 1) / 2;
+		if (!heap_before(mode, value, heap[parent])) {
+			break;
+		}
+		heap[i] = heap[parent];
+		i = parent;
+	}
+	heap[i] = value;
+}
+
+/**
+ * @brief Move the value at index i of a heap of n values down to its place.
+ */
+static inline void heap_sift_down(int *heap, u32 n, u32 i, int mode)
+{
+	int value = heap[i];
+	u32 child;
+
+	for (;;) {
+		child = 2 * i + 1;
+		if (child >= n) {
+			break;
+		}
+		if (child + 1 < n &&
+		    heap_before(mode, heap[child + 1], heap[child])) {
+			child++;
+		}
+		if (!heap_before(mode, heap[child], value)) {
+			break;
+		}
+		heap[i] = heap[child];
+		i = child;
+	}
+	heap[i] = value;
+}
+
+/**
+ * @brief Turn the n first values of the array into a heap, in O(n).
+ */
+static inline void heap_build(int *heap, u32 n, int mode)
+{
+	u32 i;
+
+	for (i = n / 2; i-- > 0;) {
+		heap_sift_down(heap, n, i, mode);
+	}
+}
+
+/**
+ * @brief Remove the first value of a heap of n values, in O(log n).
+ *
+ * @return The removed value.
+ */
+static inline int heap_pop(int *heap, u32 n, int mode)
+{
+	int top = heap[0];
+
+	heap[0] = heap[n - 1];
+	heap_sift_down(heap, n - 1, 0, mode);
+
+	return top;
+}
+
+/**
+ * @brief Add a value to a heap of n values, in O(log n).
+ */
+static inline void heap_push(int *heap, u32 n, int value, int mode)
+{
+	heap[n] = value;
+	heap_sift_up(heap, n, mode);
+}
+
+/**
+ * @brief Bucket of a latency histogram of nb_buckets buckets: bucket b
+ *        counts the latencies of b significant bits, the last one
+ *        everything above.
+ */
+static inline u32 latency_bucket(u64 latency, u32 nb_buckets)
+{
+	return min_t(u32, fls64(latency), nb_buckets - 1);
+}
+
+#endif /* FLIFO_CORE_H */
@@ -0,0 +1,383 @@
+/**
+* @file flifo_kunit.c
+* @brief KUnit suite of the ring, heap and index logic of flifo
+*        (flifo_core.h). Unlike flifo_test.c, it doesn't need the driver
+*        nor the board, and runs under UML or QEMU, for instance with:
+*
+*        ./tools/testing/kunit/kunit.py run flifo
+*
+*        once this file is copied to the kernel tree, or by loading
+*        flifo_kunit.ko in a kernel built with CONFIG_KUNIT. The
+*        microbenchmarks print the time per value in the test log.
+*/
+#include <kunit/test.h>
+#include <linux/module.h>
+#include <linux/ktime.h> /* Needed for the microbenchmarks */
+#include <linux/math64.h> /* Needed for div_u64 */
+
+#include "flifo_core.h"
+
+#define CAPACITY     16
+
+// Indices close to the wraparound of u32
+#define NEAR_WRAP    (U32_MAX - CAPACITY / 2)
+
+#define BENCH_CAPACITY 1024
+#define BENCH_BATCH    16
+#define BENCH_ROUNDS   (1 << 16)
+
+/**
+ * @brief Pseudo-random values, the same on every run.
+ */
+static u32 next_random(u32 *state)
+{
+	*state = *state * 1103515245 + 12345;
+	return *state >> 8;
+}
+
+/**
+ * @brief The counts and contiguous parts stay right across the wraparound
+ *        of the indices.
+ */
+static void flifo_test_index_wraparound(struct kunit *test)
+{
+	u32 tail = NEAR_WRAP;
+	u32 head = tail + CAPACITY / 2 + 3;
+
+	KUNIT_EXPECT_EQ(test, ring_used(head, tail, CAPACITY),
+			(u32)(CAPACITY / 2 + 3));
+	KUNIT_EXPECT_EQ(test, ring_contiguous(tail, CAPACITY, CAPACITY),
+			(u32)(CAPACITY - (tail & (CAPACITY - 1))));
+	KUNIT_EXPECT_EQ(test, ring_contiguous(head, 2, CAPACITY), 2U);
+
+	// Indices scribbled on through the mapping
+	KUNIT_EXPECT_EQ(test, ring_used(tail, head, CAPACITY), (u32)CAPACITY);
+}
+
+/**
+ * @brief Values written and read in batches come out in order while the
+ *        indices wrap around, both in the ring and in u32.
+ */
+static void flifo_test_fifo_wraparound(struct kunit *test)
+{
+	int values[CAPACITY];
+	int batch[5];
+	u32 head = NEAR_WRAP;
+	u32 tail = NEAR_WRAP;
+	int next_in = 0;
+	int next_out = 0;
+	int round;
+	int i;
+
+	for (round = 0; round < 4 * CAPACITY; round++) {
+		for (i = 0; i < ARRAY_SIZE(batch); i++) {
+			batch[i] = next_in++;
+		}
+		ring_write(values, sizeof(int), CAPACITY, head, batch,
+			   ARRAY_SIZE(batch));
+		head += ARRAY_SIZE(batch);
+		KUNIT_ASSERT_LE(test, ring_used(head, tail, CAPACITY),
+				(u32)CAPACITY);
+
+		ring_read(values, sizeof(int), CAPACITY, tail, batch,
+			  ARRAY_SIZE(batch));
+		tail += ARRAY_SIZE(batch);
+		for (i = 0; i < ARRAY_SIZE(batch); i++) {
+			KUNIT_ASSERT_EQ(test, batch[i], next_out++);
+		}
+	}
+	KUNIT_EXPECT_EQ(test, ring_used(head, tail, CAPACITY), 0U);
+}
+
+/**
+ * @brief A full ring is read back whole from any starting index, and an
+ *        empty one copies nothing.
+ */
+static void flifo_test_full_empty(struct kunit *test)
+{
+	int values[CAPACITY];
+	int in[CAPACITY];
+	int out[CAPACITY];
+	u32 start;
+	int i;
+
+	for (i = 0; i < CAPACITY; i++) {
+		in[i] = 100 + i;
+	}
+
+	for (start = NEAR_WRAP; start != NEAR_WRAP + CAPACITY; start++) {
+		memset(out, 0, sizeof(out));
+		ring_write(values, sizeof(int), CAPACITY, start, in, CAPACITY);
+		KUNIT_EXPECT_EQ(test, ring_used(start + CAPACITY, start,
+						CAPACITY),
+				(u32)CAPACITY);
+
+		ring_read(values, sizeof(int), CAPACITY, start, out, CAPACITY);
+		KUNIT_EXPECT_EQ(test, memcmp(in, out, sizeof(in)), 0);
+
+		// Nothing left, nothing to copy
+		ring_read(values, sizeof(int), CAPACITY, start, out, 0);
+		KUNIT_EXPECT_EQ(test, memcmp(in, out, sizeof(in)), 0);
+		KUNIT_EXPECT_EQ(test, ring_contiguous(start, 0, CAPACITY), 0U);
+	}
+}
+
+/**
+ * @brief LIFO gathers return the newest values first for every value size,
+ *        across the end of the ring.
+ */
+static void flifo_test_lifo_sizes(struct kunit *test)
+{
+	static const u32 sizes[] = { 1, 2, 4, 8, 12 };
+	u8 *expected;
+	u8 *values;
+	u8 *in;
+	u8 *out;
+	u32 head;
+	u32 esz;
+	u32 i;
+	u32 s;
+
+	for (s = 0; s < ARRAY_SIZE(sizes); s++) {
+		esz = sizes[s];
+		values = kunit_kzalloc(test, CAPACITY * esz, GFP_KERNEL);
+		in = kunit_kzalloc(test, CAPACITY * esz, GFP_KERNEL);
+		out = kunit_kzalloc(test, CAPACITY * esz, GFP_KERNEL);
+		KUNIT_ASSERT_NOT_ERR_OR_NULL(test, values);
+		KUNIT_ASSERT_NOT_ERR_OR_NULL(test, in);
+		KUNIT_ASSERT_NOT_ERR_OR_NULL(test, out);
+
+		for (i = 0; i < CAPACITY * esz; i++) {
+			in[i] = i;
+		}
+
+		// The values wrap around the end of the ring
+		head = NEAR_WRAP + CAPACITY / 2;
+		ring_write(values, esz, CAPACITY, head - CAPACITY, in,
+			   CAPACITY);
+		ring_gather_lifo(values, esz, CAPACITY, out, head, CAPACITY);
+
+		for (i = 0; i < CAPACITY; i++) {
+			expected = in + (CAPACITY - 1 - i) * esz;
+			KUNIT_EXPECT_EQ_MSG(test, memcmp(out + i * esz,
+							 expected, esz),
+					    0, "size %u, value %u", esz, i);
+		}
+	}
+}
+
+/**
+ * @brief Check that the n values of a heap come out sorted for the mode.
+ */
+static void expect_heap_order(struct kunit *test, int *heap, u32 n, int mode)
+{
+	int prev = heap_pop(heap, n, mode);
+	int value;
+
+	while (--n > 0) {
+		value = heap_pop(heap, n, mode);
+		KUNIT_EXPECT_FALSE(test, heap_before(mode, value, prev));
+		prev = value;
+	}
+}
+
+/**
+ * @brief Switching modes with values queued: the ring is linearized like
+ *        flifo_linearize() does, keeps the FIFO order, and the heap built on
+ *        it then returns the values by priority.
+ */
+static void flifo_test_mode_switch(struct kunit *test)
+{
+	int values[CAPACITY] = { 0 };
+	int heap[CAPACITY];
+	int in[CAPACITY - 4];
+	int out[CAPACITY - 4];
+	u32 tail = NEAR_WRAP + 3;
+	u32 nb = ARRAY_SIZE(in);
+	u32 state = 1;
+	u32 i;
+
+	for (i = 0; i < nb; i++) {
+		in[i] = next_random(&state) % 1000 - 500;
+	}
+	ring_write(values, sizeof(int), CAPACITY, tail, in, nb);
+
+	// FIFO to LIFO: half read from the tail, the rest from the head
+	ring_read(values, sizeof(int), CAPACITY, tail, out, nb / 2);
+	ring_gather_lifo(values, sizeof(int), CAPACITY, out + nb / 2,
+			 tail + nb, nb - nb / 2);
+	for (i = 0; i < nb / 2; i++) {
+		KUNIT_EXPECT_EQ(test, out[i], in[i]);
+	}
+	for (i = nb / 2; i < nb; i++) {
+		KUNIT_EXPECT_EQ(test, out[i], in[nb - 1 - (i - nb / 2)]);
+	}
+
+	// To a priority mode: linearize, then heapify
+	ring_rotate(values, CAPACITY, tail & (CAPACITY - 1));
+	KUNIT_EXPECT_EQ(test, memcmp(values, in, sizeof(in)), 0);
+
+	memcpy(heap, values, sizeof(in));
+	heap_build(heap, nb, MODE_PRIO);
+	expect_heap_order(test, heap, nb, MODE_PRIO);
+
+	memcpy(heap, values, sizeof(in));
+	heap_build(heap, nb, MODE_PRIO_MIN);
+	expect_heap_order(test, heap, nb, MODE_PRIO_MIN);
+}
+
+/**
+ * @brief Values pushed one by one, as the writers do, and popped from a
+ *        full heap come out sorted, including duplicates.
+ */
+static void flifo_test_heap_full(struct kunit *test)
+{
+	int heap[CAPACITY];
+	u32 state = 42;
+	u32 i;
+
+	for (i = 0; i < CAPACITY; i++) {
+		heap_push(heap, i, next_random(&state) % 8, MODE_PRIO);
+	}
+	expect_heap_order(test, heap, CAPACITY, MODE_PRIO);
+
+	// A single value is its own heap
+	heap_push(heap, 0, 7, MODE_PRIO_MIN);
+	KUNIT_EXPECT_EQ(test, heap_pop(heap, 1, MODE_PRIO_MIN), 7);
+}
+
+static void flifo_test_latency_bucket(struct kunit *test)
+{
+	KUNIT_EXPECT_EQ(test, latency_bucket(0, 40), 0U);
+	KUNIT_EXPECT_EQ(test, latency_bucket(1, 40), 1U);
+	KUNIT_EXPECT_EQ(test, latency_bucket(1023, 40), 10U);
+	KUNIT_EXPECT_EQ(test, latency_bucket(1024, 40), 11U);
+	KUNIT_EXPECT_EQ(test, latency_bucket(U64_MAX, 40), 39U);
+}
+
+/**
+ * @brief Time the FIFO enqueue and dequeue of batches of values of esz
+ *        bytes, and print the time per value.
+ */
+static void bench_fifo(struct kunit *test, u32 esz)
+{
+	u8 *values = kunit_kzalloc(test, BENCH_CAPACITY * esz, GFP_KERNEL);
+	u8 *batch = kunit_kzalloc(test, BENCH_BATCH * esz, GFP_KERNEL);
+	u32 head = NEAR_WRAP;
+	u32 tail = NEAR_WRAP;
+	u64 start;
+	u64 elapsed;
+	u32 i;
+
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, values);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, batch);
+
+	start = ktime_get_ns();
+	for (i = 0; i < BENCH_ROUNDS; i++) {
+		ring_write(values, esz, BENCH_CAPACITY, head, batch,
+			   BENCH_BATCH);
+		head += BENCH_BATCH;
+		ring_read(values, esz, BENCH_CAPACITY, tail, batch,
+			  BENCH_BATCH);
+		tail += BENCH_BATCH;
+	}
+	elapsed = ktime_get_ns() - start;
+
+	KUNIT_EXPECT_EQ(test, ring_used(head, tail, BENCH_CAPACITY), 0U);
+	kunit_info(test, "FIFO, %u-byte values: %llu ps per value\n", esz,
+		   div_u64(elapsed * 1000, BENCH_ROUNDS * BENCH_BATCH));
+}
+
+static void flifo_bench_fifo(struct kunit *test)
+{
+	bench_fifo(test, sizeof(int));
+	bench_fifo(test, sizeof(u64));
+	bench_fifo(test, 12);
+}
+
+/**
+ * @brief Time the LIFO gathers of a full ring of values of esz bytes.
+ */
+static void bench_lifo(struct kunit *test, u32 esz)
+{
+	u8 *values = kunit_kzalloc(test, BENCH_CAPACITY * esz, GFP_KERNEL);
+	u8 *batch = kunit_kzalloc(test, BENCH_BATCH * esz, GFP_KERNEL);
+	u32 head = NEAR_WRAP;
+	u64 start;
+	u64 elapsed;
+	u32 i;
+
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, values);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, batch);
+
+	start = ktime_get_ns();
+	for (i = 0; i < BENCH_ROUNDS; i++) {
+		ring_gather_lifo(values, esz, BENCH_CAPACITY, batch,
+				 head + i * BENCH_BATCH, BENCH_BATCH);
+	}
+	elapsed = ktime_get_ns() - start;
+
+	kunit_info(test, "LIFO, %u-byte values: %llu ps per value\n", esz,
+		   div_u64(elapsed * 1000, BENCH_ROUNDS * BENCH_BATCH));
+}
+
+static void flifo_bench_lifo(struct kunit *test)
+{
+	bench_lifo(test, sizeof(int));
+	bench_lifo(test, sizeof(u64));
+	bench_lifo(test, 12);
+}
+
+/**
+ * @brief Time the pushes and pops of a heap kept at BENCH_CAPACITY / 2
+ *        values.
+ */
+static void flifo_bench_heap(struct kunit *test)
+{
+	int *heap = kunit_kzalloc(test, BENCH_CAPACITY * sizeof(int),
+				  GFP_KERNEL);
+	u32 n = BENCH_CAPACITY / 2;
+	u32 state = 7;
+	u64 start;
+	u64 elapsed;
+	u32 i;
+
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, heap);
+	for (i = 0; i < n; i++) {
+		heap[i] = next_random(&state);
+	}
+	heap_build(heap, n, MODE_PRIO);
+
+	start = ktime_get_ns();
+	for (i = 0; i < BENCH_ROUNDS; i++) {
+		heap_push(heap, n, next_random(&state), MODE_PRIO);
+		heap_pop(heap, n + 1, MODE_PRIO);
+	}
+	elapsed = ktime_get_ns() - start;
+
+	expect_heap_order(test, heap, n, MODE_PRIO);
+	kunit_info(test, "Heap of %u values: %llu ns per push and pop\n", n,
+		   div_u64(elapsed, BENCH_ROUNDS));
+}
+
+static struct kunit_case flifo_test_cases[] = {
+	KUNIT_CASE(flifo_test_index_wraparound),
+	KUNIT_CASE(flifo_test_fifo_wraparound),
+	KUNIT_CASE(flifo_test_full_empty),
+	KUNIT_CASE(flifo_test_lifo_sizes),
+	KUNIT_CASE(flifo_test_mode_switch),
+	KUNIT_CASE(flifo_test_heap_full),
+	KUNIT_CASE(flifo_test_latency_bucket),
+	KUNIT_CASE(flifo_bench_fifo),
+	KUNIT_CASE(flifo_bench_lifo),
+	KUNIT_CASE(flifo_bench_heap),
+	{}
+};
+
+static struct kunit_suite flifo_test_suite = {
+	.name = "flifo",
+	.test_cases = flifo_test_cases,
+};
+kunit_test_suite(flifo_test_suite);
+
+MODULE_LICENSE("GPL");
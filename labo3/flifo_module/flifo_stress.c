@@ -0,0 +1,369 @@
+/**
+* @file flifo_stress.c
+* @author Rafael Dousse
+* @brief Multi-threaded stress test of the flifo device. Several producer
+*        threads write into the list while a single consumer drains it. Each
+*        value encodes its producer and a sequence number, so the consumer
+*        can check that no value is lost and that the order of each producer
+*        is kept. A second benchmark compares how the single list and the
+*        per-CPU shards scale with the number of cores, and a third one how
+*        fast a pipe is drained into the list with read/write and with
+*        splice.
+*/
+#define _GNU_SOURCE /* Needed for pthread_setaffinity_np and splice */
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include "flifo.h"
+
+#define DEVICE_PATH	   "/dev/flifo0"
+
+#define VALUES_PER_THREAD  (1 << 18)
+#define BATCH		   4
+#define MAX_PRODUCERS	   16
+#define SEQ_BITS	   24
+#define SEQ_MASK	   ((1 << SEQ_BITS) - 1)
+
+// Enough for the values in flight of all the threads of the scaling
+// benchmark, so none of them blocks
+#define SCALING_CAPACITY   (MAX_PRODUCERS * BATCH * 4)
+
+// Bytes moved from the pipe to the list, by chunks of the default size of
+// a pipe
+#define PIPE_BYTES	   (256 << 20)
+#define PIPE_CHUNK	   (64 << 10)
+#define PIPE_CAPACITY	   (PIPE_CHUNK / sizeof(int))
+
+static int fd;
+
+/**
+ * @brief Producer thread, writes VALUES_PER_THREAD values tagged with its id.
+ * @param arg Id of the producer.
+*/
+static void *producer(void *arg)
+{
+	int id = (int)(long)arg;
+	int values[BATCH];
+	int seq = 0;
+
+	while (seq < VALUES_PER_THREAD) {
+		int nb = 0;
+		for (; nb < BATCH && seq + nb < VALUES_PER_THREAD; nb++) {
+			values[nb] = (id << SEQ_BITS) | (seq + nb);
+		}
+
+		int err = write(fd, values, nb * sizeof(int));
+		if (err < 0) {
+			perror("write");
+			exit(EXIT_FAILURE);
+		}
+		// Only the values that fit have been written
+		seq += err / sizeof(int);
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief Consume all the values of nb_producers producers and check them.
+ * @param nb_producers Number of producer threads.
+ * @return Number of values received out of order.
+*/
+static int consume(int nb_producers)
+{
+	int next_seq[MAX_PRODUCERS] = { 0 };
+	int values[BATCH];
+	int total = nb_producers * VALUES_PER_THREAD;
+	int errors = 0;
+
+	for (int received = 0; received < total;) {
+		int err = read(fd, values, sizeof(values));
+		if (err < 0) {
+			perror("read");
+			exit(EXIT_FAILURE);
+		}
+
+		for (int i = 0; i < err / (int)sizeof(int); i++) {
+			int id = values[i] >> SEQ_BITS;
+			int seq = values[i] & SEQ_MASK;
+
+			if (id >= nb_producers || seq != next_seq[id]) {
+				errors++;
+			} else {
+				next_seq[id]++;
+			}
+		}
+		received += err / sizeof(int);
+	}
+
+	return errors;
+}
+
+/**
+ * @brief Run nb_producers producers against one consumer and print the
+ *        throughput.
+ * @param nb_producers Number of producer threads.
+ * @param sync Synchronisation mode of the list (SYNC_MPMC or SYNC_SPSC).
+*/
+static void run(int nb_producers, int sync)
+{
+	pthread_t threads[MAX_PRODUCERS];
+	struct timespec start, end;
+	double elapsed;
+	int errors;
+
+	if (ioctl(fd, FLIFO_CMD_RESET) < 0 ||
+	    ioctl(fd, FLIFO_CMD_CHANGE_SYNC, sync) < 0) {
+		perror("ioctl");
+		exit(EXIT_FAILURE);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (long i = 0; i < nb_producers; i++) {
+		pthread_create(&threads[i], NULL, producer, (void *)i);
+	}
+	errors = consume(nb_producers);
+	for (int i = 0; i < nb_producers; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	elapsed = (end.tv_sec - start.tv_sec) +
+		  (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("%s, %2d producer(s): %.0f values/s, %d error(s)\n",
+	       sync == SYNC_SPSC ? "SPSC" : "MPMC", nb_producers,
+	       nb_producers * VALUES_PER_THREAD / elapsed, errors);
+}
+
+/**
+ * @brief Thread of the scaling benchmark, pinned to a CPU. Writes a batch
+ *        and reads as many values back, VALUES_PER_THREAD times.
+ * @param arg CPU to run on.
+*/
+static void *worker(void *arg)
+{
+	int cpu = (int)(long)arg;
+	int values[BATCH] = { 0 };
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+
+	for (int i = 0; i < VALUES_PER_THREAD; i += BATCH) {
+		int written = write(fd, values, sizeof(values));
+		if (written < 0) {
+			perror("write");
+			exit(EXIT_FAILURE);
+		}
+
+		// Other threads may take some of them, there are always as many
+		// values in the list as in flight
+		for (int nb = 0; nb < written;) {
+			int err = read(fd, values, written - nb);
+			if (err < 0) {
+				perror("read");
+				exit(EXIT_FAILURE);
+			}
+			nb += err;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief Run nb_threads workers, each on its own core, and print the
+ *        number of values written and read per second.
+ * @param nb_threads Number of threads.
+ * @param sync Synchronisation mode of the list (SYNC_MPMC or SYNC_SHARDED).
+*/
+static void runScaling(int nb_threads, int sync)
+{
+	pthread_t threads[MAX_PRODUCERS];
+	struct timespec start, end;
+	double elapsed;
+
+	if (ioctl(fd, FLIFO_CMD_RESET) < 0 ||
+	    ioctl(fd, FLIFO_CMD_CHANGE_SYNC, sync) < 0) {
+		perror("ioctl");
+		exit(EXIT_FAILURE);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (long i = 0; i < nb_threads; i++) {
+		pthread_create(&threads[i], NULL, worker, (void *)i);
+	}
+	for (int i = 0; i < nb_threads; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	elapsed = (end.tv_sec - start.tv_sec) +
+		  (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("%s, %2d core(s): %.0f operations/s\n",
+	       sync == SYNC_SHARDED ? "Sharded" : "Single ", nb_threads,
+	       2.0 * nb_threads * VALUES_PER_THREAD / elapsed);
+
+	ioctl(fd, FLIFO_CMD_CHANGE_SYNC, SYNC_MPMC);
+}
+
+/**
+ * @brief Thread filling the pipe of the pipe benchmark with PIPE_BYTES
+ *        bytes.
+ * @param arg Write end of the pipe.
+*/
+static void *pipeFeeder(void *arg)
+{
+	static char chunk[PIPE_CHUNK];
+	int pipe_fd = (int)(long)arg;
+
+	for (long total = 0; total < PIPE_BYTES;) {
+		int err = write(pipe_fd, chunk, sizeof(chunk));
+		if (err < 0) {
+			perror("write pipe");
+			exit(EXIT_FAILURE);
+		}
+		total += err;
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief Thread draining the list during the pipe benchmark.
+ * @param arg Unused.
+*/
+static void *pipeDrainer(void *arg)
+{
+	static char chunk[PIPE_CHUNK];
+
+	(void)arg;
+	for (long total = 0; total < PIPE_BYTES;) {
+		int err = read(fd, chunk, sizeof(chunk));
+		if (err < 0) {
+			perror("read");
+			exit(EXIT_FAILURE);
+		}
+		total += err;
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief Move PIPE_BYTES bytes from a pipe to the list, while other threads
+ *        fill the pipe and drain the list, and print the throughput.
+ * @param use_splice Whether to splice the pipe into the device, instead of
+ *        reading the pipe into a buffer and writing it to the device.
+*/
+static void runPipe(int use_splice)
+{
+	static char chunk[PIPE_CHUNK];
+	pthread_t feeder, drainer;
+	struct timespec start, end;
+	double elapsed;
+	int pipe_fds[2];
+
+	if (ioctl(fd, FLIFO_CMD_RESET) < 0 || pipe(pipe_fds) < 0) {
+		perror("pipe setup");
+		exit(EXIT_FAILURE);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	pthread_create(&feeder, NULL, pipeFeeder, (void *)(long)pipe_fds[1]);
+	pthread_create(&drainer, NULL, pipeDrainer, NULL);
+
+	for (long total = 0; total < PIPE_BYTES;) {
+		int err;
+
+		if (use_splice) {
+			err = splice(pipe_fds[0], NULL, fd, NULL, PIPE_CHUNK,
+				     SPLICE_F_MOVE);
+		} else {
+			err = read(pipe_fds[0], chunk, sizeof(chunk));
+			// The list may take less than a chunk at a time
+			for (int done = 0; err > 0 && done < err;) {
+				int written = write(fd, chunk + done,
+						    err - done);
+				if (written < 0) {
+					err = written;
+					break;
+				}
+				done += written;
+			}
+		}
+		if (err <= 0) {
+			perror(use_splice ? "splice" : "read/write");
+			exit(EXIT_FAILURE);
+		}
+		total += err;
+	}
+
+	pthread_join(feeder, NULL);
+	pthread_join(drainer, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	close(pipe_fds[0]);
+	close(pipe_fds[1]);
+
+	elapsed = (end.tv_sec - start.tv_sec) +
+		  (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("Pipe to list, %s: %.1f MB/s\n",
+	       use_splice ? "splice    " : "read/write",
+	       PIPE_BYTES / elapsed / 1e6);
+}
+
+int main(int argc, char *argv[])
+{
+	int max_producers = argc > 1 ? atoi(argv[1]) : sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (max_producers < 1 || max_producers > MAX_PRODUCERS) {
+		max_producers = MAX_PRODUCERS;
+	}
+
+	fd = open(DEVICE_PATH, O_RDWR);
+	if (fd < 0) {
+		perror("open");
+		exit(EXIT_FAILURE);
+	}
+
+	if (ioctl(fd, FLIFO_CMD_CHANGE_MODE, MODE_FIFO) < 0) {
+		perror("ioctl set mode");
+		exit(EXIT_FAILURE);
+	}
+
+	// The lock-free path only allows a single producer
+	run(1, SYNC_SPSC);
+	for (int i = 1; i <= max_producers; i++) {
+		run(i, SYNC_MPMC);
+	}
+
+	// Throughput versus core count, single list against shards
+	if (ioctl(fd, FLIFO_CMD_RESIZE, SCALING_CAPACITY) < 0) {
+		perror("ioctl resize");
+		exit(EXIT_FAILURE);
+	}
+	for (int i = 1; i <= max_producers; i++) {
+		runScaling(i, SYNC_MPMC);
+		runScaling(i, SYNC_SHARDED);
+	}
+
+	// Pipe to list, bouncing through user space or not
+	if (ioctl(fd, FLIFO_CMD_RESIZE, PIPE_CAPACITY) < 0) {
+		perror("ioctl resize");
+		exit(EXIT_FAILURE);
+	}
+	runPipe(0);
+	runPipe(1);
+	ioctl(fd, FLIFO_CMD_RESIZE, NB_VALUES);
+
+	ioctl(fd, FLIFO_CMD_RESET);
+	close(fd);
+	return EXIT_SUCCESS;
+}
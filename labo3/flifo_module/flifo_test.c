@@ -7,11 +7,25 @@
 #include <unistd.h>
 #include <sys/ioctl.h>
 #include <stdlib.h>
+#include <time.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <sys/eventfd.h>
 #include "flifo.h"
 
-#define DEVICE_PATH "/dev/flifo"
+#define DEVICE_PATH "/dev/flifo0"
+#define OTHER_PATH  "/dev/flifo1"
 #define DEBUG	    0
 
+#define BENCH_NB_VALUES (1 << 20)
+
+#define FOOTPRINT_PATH	 "/sys/class/flifo/flifo0/footprint"
+#define UNBOUNDED_VALUES (1 << 16)
+#define UNBOUNDED_LIMIT	 (1 << 20)
+#define TTL_US		 100000
+
 /**
  * @brief Set the mode of the device.
  * @param fd File descriptor of the device.
@@ -53,7 +67,7 @@ void resetFLifo(int fd)
  * @param values Array of values to write.
  * @param size Size of the array.
 */
-void writeValue(int fd, int *values, int size)
+void writeValue(int fd, const int *values, int size)
 {
 	int err;
 	for (int i = 0; i < size; i++) {
@@ -93,13 +107,215 @@ void readValue(int fd, int *values, int size)
 	}
 }
 
+/**
+ * @brief Write values to the device in batches of several values per syscall.
+ * @param fd File descriptor of the device.
+ * @param values Array of values to write.
+ * @param size Size of the array.
+ * @param batch Number of values to write per syscall.
+*/
+void writeBatch(int fd, const int *values, int size, int batch)
+{
+	int err;
+	for (int i = 0; i < size; i += batch) {
+		int nb = (size - i < batch) ? size - i : batch;
+		err = write(fd, &values[i], nb * sizeof(int));
+
+		if (err < 0) {
+			perror("write");
+			exit(EXIT_FAILURE);
+		}
+		if (err != nb * sizeof(int)) {
+			printf("Short write: %d bytes instead of %zu\n", err,
+			       nb * sizeof(int));
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+/**
+ * @brief Read values from the device in batches of several values per syscall.
+ * @param fd File descriptor of the device.
+ * @param values Array to store the read values.
+ * @param size Size of the array.
+ * @param batch Number of values to read per syscall.
+*/
+void readBatch(int fd, int *values, int size, int batch)
+{
+	int err;
+	for (int i = 0; i < size; i += batch) {
+		int nb = (size - i < batch) ? size - i : batch;
+		err = read(fd, &values[i], nb * sizeof(int));
+
+		if (err < 0) {
+			perror("read");
+			exit(EXIT_FAILURE);
+		}
+		if (err != nb * sizeof(int)) {
+			printf("Short read: %d bytes instead of %zu\n", err,
+			       nb * sizeof(int));
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+/**
+ * @brief Measure how many values per second go through the device when
+ *        they are written and read back in batches of a given size.
+ * @param fd File descriptor of the device.
+ * @param batch Number of values per syscall, at most NB_VALUES.
+*/
+void benchmark(int fd, int batch)
+{
+	int values[NB_VALUES];
+	struct timespec start, end;
+	double elapsed;
+
+	for (int i = 0; i < batch; i++) {
+		values[i] = i;
+	}
+
+	resetFLifo(fd);
+	setMode(fd, MODE_FIFO);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i = 0; i < BENCH_NB_VALUES; i += batch) {
+		writeBatch(fd, values, batch, batch);
+		readBatch(fd, values, batch, batch);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	elapsed = (end.tv_sec - start.tv_sec) +
+		  (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("Batch of %2d values: %.0f values/s\n", batch,
+	       BENCH_NB_VALUES / elapsed);
+}
+
+/**
+ * @brief Check the non-blocking behaviour and the poll events of the device.
+ * @param fd File descriptor of the device opened in blocking mode.
+*/
+void testNonBlocking(int fd)
+{
+	int values[NB_VALUES] = { 0 };
+	struct pollfd pfd;
+	int fd_nb = open(DEVICE_PATH, O_RDWR | O_NONBLOCK);
+	if (fd_nb < 0) {
+		perror("open non-blocking");
+		exit(EXIT_FAILURE);
+	}
+
+	resetFLifo(fd);
+
+	// Empty list: no data to read, room to write
+	if (read(fd_nb, values, sizeof(int)) >= 0 || errno != EAGAIN) {
+		printf("Non-blocking read on empty list did not fail with EAGAIN\n");
+	}
+	pfd.fd = fd_nb;
+	pfd.events = POLLIN | POLLOUT;
+	if (poll(&pfd, 1, 0) != 1 || pfd.revents != POLLOUT) {
+		printf("Poll on empty list returned 0x%x\n", pfd.revents);
+	}
+
+	// Full list: data to read, no more room to write
+	writeBatch(fd, values, NB_VALUES, NB_VALUES);
+	if (write(fd_nb, values, sizeof(int)) >= 0 || errno != ENOSPC) {
+		printf("Non-blocking write on full list did not fail with ENOSPC\n");
+	}
+	if (poll(&pfd, 1, 0) != 1 || pfd.revents != POLLIN) {
+		printf("Poll on full list returned 0x%x\n", pfd.revents);
+	}
+
+	close(fd_nb);
+	resetFLifo(fd);
+}
+
+/**
+ * @brief Check that a blocking read sleeps until another process writes.
+ * @param fd File descriptor of the device opened in blocking mode.
+*/
+void testBlockingRead(int fd)
+{
+	static const int expected = 42;
+	int value = 0;
+	pid_t pid;
+
+	resetFLifo(fd);
+
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		exit(EXIT_FAILURE);
+	}
+	if (pid == 0) {
+		// Let the parent block on the empty list before writing
+		usleep(100000);
+		writeValue(fd, (int *)&expected, 1);
+		exit(EXIT_SUCCESS);
+	}
+
+	readValue(fd, &value, 1);
+	waitpid(pid, NULL, 0);
+
+	if (value != expected) {
+		printf("Blocking read returned %d, expected %d\n", value,
+		       expected);
+	} else {
+		printf("Blocking read woken up by the writer.\n");
+	}
+}
+
+/**
+ * @brief Same as benchmark() but the values go through the mapped ring
+ *        instead of read/write.
+ * @param fd File descriptor of the device.
+ * @param batch Number of values per push and pop, at most NB_VALUES.
+*/
+void benchmarkMapped(int fd, int batch)
+{
+	int values[NB_VALUES];
+	struct flifo_map map;
+	struct timespec start, end;
+	double elapsed;
+
+	for (int i = 0; i < batch; i++) {
+		values[i] = i;
+	}
+
+	resetFLifo(fd);
+	setMode(fd, MODE_FIFO);
+	if (ioctl(fd, FLIFO_CMD_CHANGE_SYNC, SYNC_SPSC) < 0 ||
+	    flifo_map(fd, &map) < 0) {
+		perror("map");
+		exit(EXIT_FAILURE);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i = 0; i < BENCH_NB_VALUES; i += batch) {
+		if (flifo_map_push(&map, values, batch) != batch ||
+		    flifo_map_pop(&map, values, batch) != batch) {
+			printf("Mapped ring did not move the whole batch\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	flifo_unmap(&map);
+	ioctl(fd, FLIFO_CMD_CHANGE_SYNC, SYNC_MPMC);
+
+	elapsed = (end.tv_sec - start.tv_sec) +
+		  (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("Mapped, batch of %2d values: %.0f values/s\n", batch,
+	       BENCH_NB_VALUES / elapsed);
+}
+
 /**
  * @brief Compare the read values with the expected values.
  * @param readValue Array of values to read
  * @param expected_values Array of expected values.
  * @param size Size of the arrays.
 */
-void compareValue(int *readValue, int *expected_values, int size)
+void compareValue(const int *readValue, const int *expected_values, int size)
 {
 	int errors = 0;
 	for (int i = 0; i < size; i++) {
@@ -116,6 +332,822 @@ void compareValue(int *readValue, int *expected_values, int size)
 		printf("There were %d wrong values.\n", errors);
 }
 
+/**
+ * @brief Check that values pushed in the mapped ring can be read with
+ *        read() and that values written with write() can be popped from it.
+ * @param fd File descriptor of the device.
+*/
+void testMapped(int fd)
+{
+	int values[NB_VALUES];
+	int readValues[NB_VALUES];
+	struct flifo_map map;
+
+	for (int i = 0; i < NB_VALUES; i++) {
+		values[i] = i * 3;
+	}
+
+	resetFLifo(fd);
+	setMode(fd, MODE_FIFO);
+	if (flifo_map(fd, &map) < 0) {
+		perror("map");
+		exit(EXIT_FAILURE);
+	}
+
+	// Unaligned start so both directions wrap around the ring
+	writeBatch(fd, values, NB_VALUES / 2, NB_VALUES / 2);
+	readBatch(fd, readValues, NB_VALUES / 2, NB_VALUES / 2);
+
+	flifo_map_push(&map, values, NB_VALUES);
+	readBatch(fd, readValues, NB_VALUES, NB_VALUES);
+	compareValue(readValues, values, NB_VALUES);
+
+	writeBatch(fd, values, NB_VALUES, NB_VALUES);
+	flifo_map_pop(&map, readValues, NB_VALUES);
+	compareValue(readValues, values, NB_VALUES);
+
+	// The list can't go LIFO under a user space producer
+	if (ioctl(fd, FLIFO_CMD_CHANGE_MODE, MODE_LIFO) == 0) {
+		printf("LIFO mode accepted while the ring is mapped\n");
+		setMode(fd, MODE_FIFO);
+	}
+
+	flifo_unmap(&map);
+}
+
+/**
+ * @brief Set the capacity of the device.
+ * @param fd File descriptor of the device.
+ * @param capacity New capacity.
+*/
+void resizeFLifo(int fd, unsigned long capacity)
+{
+	int err = ioctl(fd, FLIFO_CMD_RESIZE, capacity);
+	if (err < 0) {
+		perror("ioctl resize");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/**
+ * @brief Check that resizing the list keeps the queued values in order.
+ * @param fd File descriptor of the device.
+*/
+void testResize(int fd)
+{
+	static const int size = 4 * NB_VALUES;
+	int values[4 * NB_VALUES];
+	int readValues[4 * NB_VALUES];
+
+	for (int i = 0; i < size; i++) {
+		values[i] = i;
+	}
+
+	resizeFLifo(fd, NB_VALUES);
+	resetFLifo(fd);
+	setMode(fd, MODE_FIFO);
+
+	// Wrap the ring around before filling it
+	writeBatch(fd, values, NB_VALUES / 2, NB_VALUES / 2);
+	readBatch(fd, readValues, NB_VALUES / 2, NB_VALUES / 2);
+	writeBatch(fd, values, NB_VALUES, NB_VALUES);
+
+	// Too small for the queued values
+	if (ioctl(fd, FLIFO_CMD_RESIZE, NB_VALUES / 2) == 0) {
+		printf("Resize below the number of queued values accepted\n");
+	}
+
+	// Grow and fill the new space
+	resizeFLifo(fd, size);
+	writeBatch(fd, values + NB_VALUES, size - NB_VALUES, size - NB_VALUES);
+	readBatch(fd, readValues, size, size);
+	compareValue(readValues, values, size);
+
+	resizeFLifo(fd, NB_VALUES);
+	resetFLifo(fd);
+}
+
+/**
+ * @brief Check that two minors are independent lists. Skipped when the
+ *        module is loaded with a single device.
+ * @param fd File descriptor of the first device.
+*/
+void testIndependentMinors(int fd)
+{
+	int values[NB_VALUES];
+	int value;
+	int fd_other = open(OTHER_PATH, O_RDWR | O_NONBLOCK);
+	if (fd_other < 0) {
+		printf("Single device, minors independence not tested.\n");
+		return;
+	}
+
+	for (int i = 0; i < NB_VALUES; i++) {
+		values[i] = i;
+	}
+
+	resetFLifo(fd);
+	resetFLifo(fd_other);
+	setMode(fd_other, MODE_LIFO);
+
+	writeBatch(fd, values, NB_VALUES, NB_VALUES);
+	if (read(fd_other, &value, sizeof(int)) >= 0 || errno != EAGAIN) {
+		printf("Values written to one minor visible on the other\n");
+	}
+
+	// The mode of the other minor must not affect this one
+	writeBatch(fd_other, &values[1], 1, 1);
+	readValue(fd, &value, 1);
+	if (value != values[0]) {
+		printf("Minor read %d instead of %d\n", value, values[0]);
+	} else {
+		printf("Minors are independent.\n");
+	}
+
+	resetFLifo(fd);
+	resetFLifo(fd_other);
+	setMode(fd_other, MODE_FIFO);
+	close(fd_other);
+}
+
+/**
+ * @brief Check the statistics counters of the device.
+ * @param fd File descriptor of the device.
+*/
+void testStats(int fd)
+{
+	int values[NB_VALUES] = { 0 };
+	struct flifo_stats stats;
+	int fd_nb = open(DEVICE_PATH, O_RDWR | O_NONBLOCK);
+	if (fd_nb < 0) {
+		perror("open non-blocking");
+		exit(EXIT_FAILURE);
+	}
+
+	resetFLifo(fd);
+	setMode(fd, MODE_FIFO);
+	if (ioctl(fd, FLIFO_CMD_RESET_STATS) < 0) {
+		perror("ioctl reset stats");
+		exit(EXIT_FAILURE);
+	}
+
+	writeBatch(fd, values, NB_VALUES, NB_VALUES);
+	write(fd_nb, values, sizeof(int));
+	readBatch(fd, values, NB_VALUES / 2, NB_VALUES / 2);
+	setMode(fd, MODE_LIFO);
+	readBatch(fd, values, NB_VALUES / 2, NB_VALUES / 2);
+	read(fd_nb, values, sizeof(int));
+	setMode(fd, MODE_FIFO);
+
+	if (ioctl(fd, FLIFO_CMD_GET_STATS, &stats) < 0) {
+		perror("ioctl get stats");
+		exit(EXIT_FAILURE);
+	}
+
+	if (stats.enqueues != NB_VALUES || stats.dequeues != NB_VALUES ||
+	    stats.full != 1 || stats.empty != 1 || stats.mode_switches != 2 ||
+	    stats.depth != 0 || stats.high_water != NB_VALUES) {
+		printf("Wrong statistics: enqueues %llu, dequeues %llu, "
+		       "full %llu, empty %llu, mode switches %llu, depth %u, "
+		       "high water %u\n",
+		       (unsigned long long)stats.enqueues,
+		       (unsigned long long)stats.dequeues,
+		       (unsigned long long)stats.full,
+		       (unsigned long long)stats.empty,
+		       (unsigned long long)stats.mode_switches, stats.depth,
+		       stats.high_water);
+	} else {
+		printf("Statistics are correct.\n");
+	}
+
+	close(fd_nb);
+}
+
+/**
+ * @brief Check the priority modes, including a switch with values queued.
+ * @param fd File descriptor of the device.
+*/
+void testPrio(int fd)
+{
+	static const int unordered[NB_VALUES] = {
+		7, -3, 12, 0, 5, 15, -8, 2, 9, 1, 14, -1, 3, 11, 6, 4
+	};
+	int readValues[NB_VALUES];
+	int errors = 0;
+
+	// Largest first, the ring wrapped around before the switch
+	resetFLifo(fd);
+	setMode(fd, MODE_FIFO);
+	writeBatch(fd, unordered, NB_VALUES / 2, NB_VALUES / 2);
+	readBatch(fd, readValues, NB_VALUES / 2, NB_VALUES / 2);
+	writeBatch(fd, unordered, NB_VALUES, NB_VALUES);
+	setMode(fd, MODE_PRIO);
+	readBatch(fd, readValues, NB_VALUES, NB_VALUES);
+	for (int i = 1; i < NB_VALUES; i++) {
+		errors += readValues[i - 1] < readValues[i];
+	}
+
+	// Smallest first, values added after the switch
+	resetFLifo(fd);
+	setMode(fd, MODE_PRIO_MIN);
+	writeBatch(fd, unordered, NB_VALUES, 3);
+	readBatch(fd, readValues, NB_VALUES, 5);
+	for (int i = 1; i < NB_VALUES; i++) {
+		errors += readValues[i - 1] > readValues[i];
+	}
+
+	if (errors == 0) {
+		printf("Priority modes return the values in order.\n");
+	} else {
+		printf("Priority modes: %d values out of order\n", errors);
+	}
+
+	setMode(fd, MODE_FIFO);
+	resetFLifo(fd);
+}
+
+/**
+ * @brief Measure the operations per second of a mode, filling a list of
+ *        size values and draining it in batches of NB_VALUES.
+ * @param fd File descriptor of the device.
+ * @param mode Mode to measure.
+ * @param size Capacity of the list used for the measure.
+*/
+void benchmarkMode(int fd, int mode, int size)
+{
+	int *values = malloc(size * sizeof(int));
+	struct timespec start, end;
+	double elapsed;
+	int rounds = BENCH_NB_VALUES / size;
+
+	if (values == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	for (int i = 0; i < size; i++) {
+		values[i] = rand();
+	}
+
+	resizeFLifo(fd, size);
+	resetFLifo(fd);
+	setMode(fd, mode);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i = 0; i < rounds; i++) {
+		writeBatch(fd, values, size, NB_VALUES);
+		readBatch(fd, values, size, NB_VALUES);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	elapsed = (end.tv_sec - start.tv_sec) +
+		  (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("Mode %d, %d values queued: %.0f operations/s\n", mode, size,
+	       2.0 * rounds * size / elapsed);
+
+	setMode(fd, MODE_FIFO);
+	resizeFLifo(fd, NB_VALUES);
+	free(values);
+}
+
+/**
+ * @brief Check that a full list in overwrite mode drops its oldest values.
+ * @param fd File descriptor of the device.
+*/
+void testOverwrite(int fd)
+{
+	static const int extra = 4;
+	int values[NB_VALUES + 4];
+	int readValues[NB_VALUES];
+	unsigned long long dropped = 0;
+
+	for (int i = 0; i < NB_VALUES + extra; i++) {
+		values[i] = i;
+	}
+
+	resetFLifo(fd);
+	setMode(fd, MODE_FIFO);
+	ioctl(fd, FLIFO_CMD_RESET_STATS);
+	if (ioctl(fd, FLIFO_CMD_SET_OVERWRITE, 1) < 0) {
+		perror("ioctl set overwrite");
+		exit(EXIT_FAILURE);
+	}
+
+	// The last writes would block without overwrite
+	writeBatch(fd, values, NB_VALUES + extra, 1);
+	readBatch(fd, readValues, NB_VALUES, NB_VALUES);
+	compareValue(readValues, values + extra, NB_VALUES);
+
+	if (ioctl(fd, FLIFO_CMD_GET_DROPPED, &dropped) < 0 ||
+	    dropped != extra) {
+		printf("Dropped count is %llu, expected %d\n", dropped, extra);
+	}
+
+	ioctl(fd, FLIFO_CMD_SET_OVERWRITE, 0);
+	resetFLifo(fd);
+}
+
+static volatile sig_atomic_t sigioCount;
+
+/**
+ * @brief SIGIO handler counting the watermark notifications.
+ * @param sig Received signal.
+*/
+void onSigio(int sig)
+{
+	(void)sig;
+	sigioCount++;
+}
+
+/**
+ * @brief Check the poll events of the list against the expected ones.
+ * @param fd File descriptor of the device.
+ * @param expected Expected POLLPRI and POLLOUT events.
+ * @param step Description of the step, printed on mismatch.
+*/
+void checkPollEvents(int fd, short expected, const char *step)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLOUT | POLLPRI };
+
+	poll(&pfd, 1, 0);
+	if ((pfd.revents & (POLLOUT | POLLPRI)) != expected) {
+		printf("Watermarks, %s: poll events 0x%x, expected 0x%x\n",
+		       step, pfd.revents, expected);
+	}
+}
+
+/**
+ * @brief Check that crossing the watermarks raises POLLPRI and SIGIO, and
+ *        that draining under the low watermark releases the producers.
+ * @param fd File descriptor of the device.
+*/
+void testWatermarks(int fd)
+{
+	struct flifo_watermarks marks = { .low = 4, .high = 12 };
+	int values[NB_VALUES];
+
+	for (int i = 0; i < NB_VALUES; i++) {
+		values[i] = i;
+	}
+
+	resetFLifo(fd);
+	setMode(fd, MODE_FIFO);
+	if (ioctl(fd, FLIFO_CMD_SET_WATERMARKS, &marks) < 0) {
+		perror("ioctl set watermarks");
+		exit(EXIT_FAILURE);
+	}
+
+	sigioCount = 0;
+	signal(SIGIO, onSigio);
+	fcntl(fd, F_SETOWN, getpid());
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_ASYNC);
+
+	writeBatch(fd, values, marks.high - 1, NB_VALUES);
+	checkPollEvents(fd, POLLOUT, "under the high watermark");
+	writeBatch(fd, values, 1, 1);
+	checkPollEvents(fd, POLLPRI, "at the high watermark");
+
+	// Still throttled until the low watermark is reached
+	readBatch(fd, values, marks.high - marks.low - 1, NB_VALUES);
+	checkPollEvents(fd, POLLPRI, "over the low watermark");
+	readBatch(fd, values, 1, 1);
+	checkPollEvents(fd, POLLOUT, "at the low watermark");
+
+	// One more for the values arriving in the empty list
+	if (sigioCount != 3) {
+		printf("Watermarks: %d SIGIO received, expected 3\n",
+		       (int)sigioCount);
+	}
+
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_ASYNC);
+	signal(SIGIO, SIG_DFL);
+	marks.high = 0;
+	ioctl(fd, FLIFO_CMD_SET_WATERMARKS, &marks);
+	resetFLifo(fd);
+}
+
+/**
+ * @brief Compare two ints for qsort.
+*/
+int compareInts(const void *a, const void *b)
+{
+	return *(const int *)a - *(const int *)b;
+}
+
+/**
+ * @brief Check that the per-CPU shards keep all the values, in any order,
+ *        and that the values left in the shards are moved back to the
+ *        single list.
+ * @param fd File descriptor of the device.
+*/
+void testSharded(int fd)
+{
+	int values[NB_VALUES];
+	int readValues[NB_VALUES];
+
+	for (int i = 0; i < NB_VALUES; i++) {
+		values[i] = i;
+	}
+
+	resetFLifo(fd);
+	setMode(fd, MODE_FIFO);
+	if (ioctl(fd, FLIFO_CMD_CHANGE_SYNC, SYNC_SHARDED) < 0) {
+		perror("ioctl change sync");
+		exit(EXIT_FAILURE);
+	}
+
+	// The values of a task that migrated may come back in another order
+	writeBatch(fd, values, NB_VALUES, 1);
+	readBatch(fd, readValues, NB_VALUES, NB_VALUES);
+	qsort(readValues, NB_VALUES, sizeof(int), compareInts);
+	compareValue(readValues, values, NB_VALUES);
+
+	writeBatch(fd, values, NB_VALUES / 2, NB_VALUES);
+	if (ioctl(fd, FLIFO_CMD_CHANGE_SYNC, SYNC_MPMC) < 0) {
+		perror("ioctl change sync");
+		exit(EXIT_FAILURE);
+	}
+	readBatch(fd, readValues, NB_VALUES / 2, NB_VALUES);
+	qsort(readValues, NB_VALUES / 2, sizeof(int), compareInts);
+	compareValue(readValues, values, NB_VALUES / 2);
+
+	resetFLifo(fd);
+}
+
+/**
+ * @brief Read the memory footprint of the first list from sysfs.
+ * @return The footprint in bytes, or -1 if it can't be read.
+*/
+long readFootprint(void)
+{
+	FILE *file = fopen(FOOTPRINT_PATH, "r");
+	long footprint = -1;
+
+	if (file == NULL) {
+		perror("fopen footprint");
+		return -1;
+	}
+	if (fscanf(file, "%ld", &footprint) != 1) {
+		footprint = -1;
+	}
+	fclose(file);
+
+	return footprint;
+}
+
+/**
+ * @brief Check that an unbounded list absorbs a burst much larger than its
+ *        capacity, and that its segments are released once drained.
+ * @param fd File descriptor of the device.
+*/
+void testUnbounded(int fd)
+{
+	static const int burst = UNBOUNDED_VALUES;
+	int *values = malloc(burst * sizeof(int));
+	int *readValues = malloc(burst * sizeof(int));
+	long idle;
+	long full;
+
+	if (values == NULL || readValues == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	for (int i = 0; i < burst; i++) {
+		values[i] = i;
+	}
+
+	resetFLifo(fd);
+	setMode(fd, MODE_FIFO);
+	if (ioctl(fd, FLIFO_CMD_SET_UNBOUNDED, UNBOUNDED_LIMIT) < 0) {
+		perror("ioctl set unbounded");
+		exit(EXIT_FAILURE);
+	}
+	idle = readFootprint();
+
+	writeBatch(fd, values, burst, NB_VALUES);
+	full = readFootprint();
+	if (full <= idle) {
+		printf("Footprint %ld with a burst, %ld idle\n", full, idle);
+	}
+
+	readBatch(fd, readValues, burst, NB_VALUES);
+	compareValue(readValues, values, burst);
+	if (readFootprint() >= full) {
+		printf("Segments not released after draining\n");
+	}
+
+	if (ioctl(fd, FLIFO_CMD_SET_UNBOUNDED, 0) < 0) {
+		perror("ioctl set unbounded");
+		exit(EXIT_FAILURE);
+	}
+	resetFLifo(fd);
+	free(values);
+	free(readValues);
+}
+
+/**
+ * @brief Set how the writers treat a slow reader in MODE_BROADCAST.
+ * @param fd File descriptor of the reader.
+ * @param policy SLOW_BLOCK or SLOW_DROP.
+*/
+void setSlowPolicy(int fd, int policy)
+{
+	if (ioctl(fd, FLIFO_CMD_SET_SLOW_POLICY, policy) < 0) {
+		perror("ioctl set slow policy");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/**
+ * @brief Check that every reader gets all the values in MODE_BROADCAST,
+ *        and that a dropping reader skips the overwritten values and
+ *        reports them in its lag.
+ * @param fd File descriptor of the device, used as the writer.
+*/
+void testBroadcast(int fd)
+{
+	int values[NB_VALUES + NB_VALUES / 2];
+	int readValues[NB_VALUES];
+	unsigned long long lag = 0;
+	int logger = open(DEVICE_PATH, O_RDONLY);
+	int display = open(DEVICE_PATH, O_RDONLY);
+
+	if (logger < 0 || display < 0) {
+		perror("open");
+		exit(EXIT_FAILURE);
+	}
+	for (int i = 0; i < NB_VALUES + NB_VALUES / 2; i++) {
+		values[i] = i;
+	}
+
+	// The writer also reads the device, it must not hold itself back
+	resetFLifo(fd);
+	setSlowPolicy(fd, SLOW_DROP);
+	setMode(fd, MODE_BROADCAST);
+
+	writeBatch(fd, values, NB_VALUES, NB_VALUES);
+	readBatch(logger, readValues, NB_VALUES, NB_VALUES);
+	compareValue(readValues, values, NB_VALUES);
+	readBatch(display, readValues, NB_VALUES, NB_VALUES);
+	compareValue(readValues, values, NB_VALUES);
+
+	// Only the logger holds the writer back now
+	setSlowPolicy(display, SLOW_DROP);
+	writeBatch(fd, values, NB_VALUES, NB_VALUES);
+	readBatch(logger, readValues, NB_VALUES, NB_VALUES);
+	writeBatch(fd, values + NB_VALUES, NB_VALUES / 2, NB_VALUES);
+	readBatch(logger, readValues, NB_VALUES / 2, NB_VALUES);
+
+	// The display only gets the last NB_VALUES values
+	readBatch(display, readValues, NB_VALUES, NB_VALUES);
+	compareValue(readValues, values + NB_VALUES / 2, NB_VALUES);
+	if (ioctl(display, FLIFO_CMD_GET_LAG, &lag) < 0 ||
+	    lag != NB_VALUES / 2) {
+		printf("Lag is %llu, expected %d\n", lag, NB_VALUES / 2);
+	}
+
+	close(logger);
+	close(display);
+	setMode(fd, MODE_FIFO);
+	setSlowPolicy(fd, SLOW_BLOCK);
+	resetFLifo(fd);
+}
+
+/**
+ * @brief Check that the values older than the TTL are dropped by the
+ *        readers and counted as expired.
+ * @param fd File descriptor of the device.
+*/
+void testTtl(int fd)
+{
+	int values[NB_VALUES] = { 0 };
+	struct flifo_stats stats;
+	int fd_nb = open(DEVICE_PATH, O_RDWR | O_NONBLOCK);
+
+	if (fd_nb < 0) {
+		perror("open non-blocking");
+		exit(EXIT_FAILURE);
+	}
+
+	resetFLifo(fd);
+	setMode(fd, MODE_FIFO);
+	ioctl(fd, FLIFO_CMD_RESET_STATS);
+	if (ioctl(fd, FLIFO_CMD_SET_TTL, TTL_US) < 0) {
+		perror("ioctl set ttl");
+		exit(EXIT_FAILURE);
+	}
+
+	// Fresh values are read
+	writeBatch(fd, values, NB_VALUES / 2, NB_VALUES);
+	readBatch(fd, values, NB_VALUES / 2, NB_VALUES);
+
+	// Stale ones are gone
+	writeBatch(fd, values, NB_VALUES, NB_VALUES);
+	usleep(2 * TTL_US);
+	if (read(fd_nb, values, sizeof(values)) >= 0 || errno != EAGAIN) {
+		printf("Expired values were read\n");
+	}
+
+	ioctl(fd, FLIFO_CMD_GET_STATS, &stats);
+	if (stats.expired != NB_VALUES ||
+	    stats.dequeues != NB_VALUES / 2) {
+		printf("Expired %llu, dequeued %llu, expected %d and %d\n",
+		       (unsigned long long)stats.expired,
+		       (unsigned long long)stats.dequeues, NB_VALUES,
+		       NB_VALUES / 2);
+	}
+
+	ioctl(fd, FLIFO_CMD_SET_TTL, 0);
+	resetFLifo(fd);
+	close(fd_nb);
+}
+
+/**
+ * @brief Read the counter of an eventfd without blocking.
+ * @param efd File descriptor of the eventfd.
+ * @return Value of the counter, 0 if it wasn't signalled.
+*/
+unsigned long long readEventfd(int efd)
+{
+	eventfd_t count;
+
+	if (eventfd_read(efd, &count) < 0) {
+		return 0;
+	}
+	return count;
+}
+
+/**
+ * @brief Check that the eventfd and SIGIO only fire once for a burst of
+ *        writes into an empty list.
+ * @param fd File descriptor of the device.
+*/
+void testArrival(int fd)
+{
+	int values[NB_VALUES] = { 0 };
+	unsigned long long count;
+	int efd = eventfd(0, EFD_NONBLOCK);
+
+	if (efd < 0) {
+		perror("eventfd");
+		exit(EXIT_FAILURE);
+	}
+
+	resetFLifo(fd);
+	setMode(fd, MODE_FIFO);
+	if (ioctl(fd, FLIFO_CMD_SET_EVENTFD, efd) < 0) {
+		perror("ioctl set eventfd");
+		exit(EXIT_FAILURE);
+	}
+
+	sigioCount = 0;
+	signal(SIGIO, onSigio);
+	fcntl(fd, F_SETOWN, getpid());
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_ASYNC);
+
+	// Only the first write of the burst finds the list empty
+	writeBatch(fd, values, NB_VALUES / 2, 1);
+	count = readEventfd(efd);
+	if (count != 1 || sigioCount != 1) {
+		printf("Burst: eventfd %llu, %d SIGIO, expected 1 and 1\n",
+		       count, (int)sigioCount);
+	}
+
+	// Nothing while values are left, then again once drained
+	readBatch(fd, values, NB_VALUES / 4, NB_VALUES);
+	writeBatch(fd, values, 1, 1);
+	count = readEventfd(efd);
+	if (count != 0) {
+		printf("Eventfd signalled for a non-empty list\n");
+	}
+	readBatch(fd, values, NB_VALUES / 4 + 1, NB_VALUES);
+	writeBatch(fd, values, 1, 1);
+	count = readEventfd(efd);
+	if (count != 1 || sigioCount != 2) {
+		printf("Refill: eventfd %llu, %d SIGIO, expected 1 and 2\n",
+		       count, (int)sigioCount);
+	}
+
+	// Detached, the eventfd stays quiet
+	ioctl(fd, FLIFO_CMD_SET_EVENTFD, -1);
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_ASYNC);
+	signal(SIGIO, SIG_DFL);
+	resetFLifo(fd);
+	writeBatch(fd, values, 1, 1);
+	if (readEventfd(efd) != 0) {
+		printf("Detached eventfd was signalled\n");
+	}
+
+	resetFLifo(fd);
+	close(efd);
+}
+
+/**
+ * @brief Fixed-size record used to test the lists of records.
+*/
+struct record {
+	int id;
+	unsigned short len;
+	char tag[6];
+};
+
+/**
+ * @brief Set the size of the values of the list, exit on failure.
+ * @param fd File descriptor of the device.
+ * @param size Size of a value in bytes.
+*/
+void setElemSize(int fd, int size)
+{
+	if (ioctl(fd, FLIFO_CMD_SET_ELEM_SIZE, size) < 0) {
+		perror("ioctl set elem size");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/**
+ * @brief Check that lists of 64-bit values and of records keep the order
+ *        of the FIFO and LIFO modes, and only move whole values.
+ * @param fd File descriptor of the device.
+*/
+void testElemSize(int fd)
+{
+	unsigned long long wide[NB_VALUES];
+	unsigned long long readWide[NB_VALUES];
+	struct record records[NB_VALUES];
+	struct record readRecords[NB_VALUES];
+
+	for (int i = 0; i < NB_VALUES; i++) {
+		wide[i] = (1ULL << 40) + i;
+		records[i].id = i;
+		records[i].len = 100 + i;
+		snprintf(records[i].tag, sizeof(records[i].tag), "r%d", i);
+	}
+
+	resetFLifo(fd);
+	setMode(fd, MODE_FIFO);
+	setElemSize(fd, sizeof(wide[0]));
+
+	// 64-bit values, in both orders
+	if (write(fd, wide, sizeof(wide)) != sizeof(wide) ||
+	    read(fd, readWide, sizeof(readWide)) != sizeof(readWide) ||
+	    memcmp(wide, readWide, sizeof(wide)) != 0) {
+		printf("64-bit values not read back in FIFO order\n");
+	}
+	setMode(fd, MODE_LIFO);
+	if (write(fd, wide, sizeof(wide)) != sizeof(wide) ||
+	    read(fd, readWide, sizeof(readWide)) != sizeof(readWide)) {
+		printf("64-bit values not read back in LIFO mode\n");
+	}
+	for (int i = 0; i < NB_VALUES; i++) {
+		if (readWide[i] != wide[NB_VALUES - 1 - i]) {
+			printf("64-bit value %d is %llu in LIFO mode\n", i,
+			       readWide[i]);
+			break;
+		}
+	}
+
+	// Half a value can't be moved, and the heap only compares ints
+	if (write(fd, wide, sizeof(int)) >= 0 || errno != EINVAL) {
+		printf("Partial 64-bit value was written\n");
+	}
+	if (ioctl(fd, FLIFO_CMD_CHANGE_MODE, MODE_PRIO) >= 0) {
+		printf("Priority mode accepted 64-bit values\n");
+	}
+
+	// The size can't change under queued values
+	write(fd, wide, sizeof(wide[0]));
+	if (ioctl(fd, FLIFO_CMD_SET_ELEM_SIZE, sizeof(records[0])) >= 0 ||
+	    errno != EBUSY) {
+		printf("Value size changed with values queued\n");
+	}
+	resetFLifo(fd);
+
+	// Records, through the generic copy
+	setElemSize(fd, sizeof(records[0]));
+	setMode(fd, MODE_FIFO);
+	if (write(fd, records, sizeof(records)) != sizeof(records) ||
+	    read(fd, readRecords, sizeof(readRecords)) != sizeof(readRecords) ||
+	    memcmp(records, readRecords, sizeof(records)) != 0) {
+		printf("Records not read back in FIFO order\n");
+	}
+	setMode(fd, MODE_LIFO);
+	if (write(fd, records, sizeof(records)) != sizeof(records) ||
+	    read(fd, readRecords, sizeof(readRecords)) != sizeof(readRecords)) {
+		printf("Records not read back in LIFO mode\n");
+	}
+	for (int i = 0; i < NB_VALUES; i++) {
+		if (memcmp(&readRecords[i], &records[NB_VALUES - 1 - i],
+			   sizeof(records[0])) != 0) {
+			printf("Record %d is %d in LIFO mode\n", i,
+			       readRecords[i].id);
+			break;
+		}
+	}
+
+	setMode(fd, MODE_FIFO);
+	setElemSize(fd, sizeof(int));
+	resetFLifo(fd);
+}
+
 /**
  * @brief Concatenate two arrays in a new one. For the test to work, the size must be even.
  * @param dest Destination array.
@@ -123,7 +1155,7 @@ void compareValue(int *readValue, int *expected_values, int size)
  * @param srcLIFO Source array for the second half in LIFO mode.
  * @param size Size of the arrays.
 */
-void concat(int *dest, int *srcFIFO, int *srcLIFO, int size)
+void concat(int *dest, const int *srcFIFO, const int *srcLIFO, int size)
 {
 	// Check for null pointers
 	if (!dest || !srcFIFO || !srcLIFO) {
@@ -165,6 +1197,9 @@ int main()
 		exit(EXIT_FAILURE);
 	}
 
+	// The tests below expect the default capacity
+	resizeFLifo(fd, NB_VALUES);
+
 	// Values to write and read
 	static const int writeValues[NB_VALUES] = {
 		0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15
@@ -208,6 +1243,59 @@ int main()
 
 	compareValue(readValues, testFifoLifo, NB_VALUES);
 
+	// Test the whole list in a single write and a single read
+	resetFLifo(fd);
+	setMode(fd, MODE_FIFO);
+	writeBatch(fd, writeValues, NB_VALUES, NB_VALUES);
+	readBatch(fd, readValues, NB_VALUES, NB_VALUES);
+	compareValue(readValues, writeValues, NB_VALUES);
+
+	resetFLifo(fd);
+	setMode(fd, MODE_LIFO);
+	writeBatch(fd, writeValues, NB_VALUES, NB_VALUES);
+	readBatch(fd, readValues, NB_VALUES, NB_VALUES);
+	compareValue(readValues, expectedValue_lifo, NB_VALUES);
+
+	// A write bigger than the free space only stores what fits
+	int overflow[NB_VALUES + 4] = { 0 };
+	resetFLifo(fd);
+	if (write(fd, overflow, sizeof(overflow)) != NB_VALUES * sizeof(int)) {
+		printf("Oversized write did not stop at the list capacity\n");
+	}
+
+	testNonBlocking(fd);
+	testBlockingRead(fd);
+	testMapped(fd);
+	testResize(fd);
+	testIndependentMinors(fd);
+	testStats(fd);
+	testPrio(fd);
+	testOverwrite(fd);
+	testWatermarks(fd);
+	testSharded(fd);
+	testUnbounded(fd);
+	testBroadcast(fd);
+	testTtl(fd);
+	testElemSize(fd);
+	testArrival(fd);
+
+	// Throughput depending on the number of values per syscall
+	static const int batches[] = { 1, 4, 8, NB_VALUES };
+	for (int i = 0; i < sizeof(batches) / sizeof(batches[0]); i++) {
+		benchmark(fd, batches[i]);
+	}
+	for (int i = 0; i < sizeof(batches) / sizeof(batches[0]); i++) {
+		benchmarkMapped(fd, batches[i]);
+	}
+
+	// Priority queue against FIFO, both through read/write
+	static const int sizes[] = { NB_VALUES, 1024, 65536 };
+	for (int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		benchmarkMode(fd, MODE_FIFO, sizes[i]);
+		benchmarkMode(fd, MODE_PRIO, sizes[i]);
+	}
+
+	resetFLifo(fd);
 	close(fd);
 	return EXIT_SUCCESS;
 }
\ No newline at end of file
@@ -0,0 +1,179 @@
+/**
+* @file libflifo.c
+* @brief User space library of the flifo device, see libflifo.h.
+*/
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include "libflifo.h"
+
+/**
+ * struct flifo_dev - Handle of a flifo device
+ * @fd:       File descriptor of the device.
+ * @nonblock: The device was opened with O_NONBLOCK.
+ * @spsc:     FLIFO_OPT_SPSC was given, the ring may be mapped.
+ * @mapped:   The values go through @map.
+ * @map:      Mapping of the ring, valid if @mapped.
+ */
+struct flifo_dev {
+	int fd;
+	int nonblock;
+	int spsc;
+	int mapped;
+	struct flifo_map map;
+};
+
+/**
+ * @brief Map the ring if the handle allows it. The driver refuses the
+ *        mapping outside of FIFO mode, the values then go through the
+ *        syscalls.
+*/
+static void flifo_try_map(struct flifo_dev *dev)
+{
+	if (dev->spsc && !dev->mapped) {
+		dev->mapped = flifo_map(dev->fd, &dev->map) == 0;
+	}
+}
+
+static void flifo_drop_map(struct flifo_dev *dev)
+{
+	if (dev->mapped) {
+		flifo_unmap(&dev->map);
+		dev->mapped = 0;
+	}
+}
+
+struct flifo_dev *flifo_open(const char *path, int flags,
+			     unsigned int options)
+{
+	struct flifo_dev *dev = calloc(1, sizeof(*dev));
+
+	if (dev == NULL) {
+		return NULL;
+	}
+
+	dev->fd = open(path, flags);
+	if (dev->fd < 0) {
+		free(dev);
+		return NULL;
+	}
+
+	dev->nonblock = (flags & O_NONBLOCK) != 0;
+	dev->spsc = (options & FLIFO_OPT_SPSC) != 0;
+	flifo_try_map(dev);
+
+	return dev;
+}
+
+void flifo_close(struct flifo_dev *dev)
+{
+	if (dev == NULL) {
+		return;
+	}
+
+	flifo_drop_map(dev);
+	close(dev->fd);
+	free(dev);
+}
+
+int flifo_fd(const struct flifo_dev *dev)
+{
+	return dev->fd;
+}
+
+int flifo_is_mapped(const struct flifo_dev *dev)
+{
+	return dev->mapped;
+}
+
+int flifo_set_mode(struct flifo_dev *dev, int mode)
+{
+	int was_mapped = dev->mapped;
+
+	// The driver refuses the other modes while the ring is mapped
+	if (mode != MODE_FIFO) {
+		flifo_drop_map(dev);
+	}
+
+	if (ioctl(dev->fd, FLIFO_CMD_CHANGE_MODE, mode) < 0) {
+		int err = errno;
+
+		if (was_mapped) {
+			flifo_try_map(dev);
+		}
+		errno = err;
+		return -1;
+	}
+
+	if (mode == MODE_FIFO) {
+		flifo_try_map(dev);
+	}
+	return 0;
+}
+
+int flifo_reset(struct flifo_dev *dev)
+{
+	return ioctl(dev->fd, FLIFO_CMD_RESET) < 0 ? -1 : 0;
+}
+
+ssize_t flifo_push_n(struct flifo_dev *dev, const int *values, size_t n)
+{
+	size_t done = 0;
+	ssize_t err;
+
+	while (done < n) {
+		if (dev->mapped) {
+			done += flifo_map_push(&dev->map, values + done,
+					       n - done);
+			if (done == n) {
+				break;
+			}
+		}
+
+		// No mapping, or the ring is full and the driver sleeps until
+		// the consumer makes room
+		err = write(dev->fd, values + done, (n - done) * sizeof(int));
+		if (err < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (done > 0) {
+				break;
+			}
+			return -1;
+		}
+		done += err / sizeof(int);
+
+		if (dev->nonblock) {
+			break;
+		}
+	}
+
+	return done;
+}
+
+ssize_t flifo_pop_n(struct flifo_dev *dev, int *values, size_t n)
+{
+	ssize_t err;
+
+	if (n == 0) {
+		return 0;
+	}
+
+	if (dev->mapped) {
+		err = flifo_map_pop(&dev->map, values, n);
+		if (err > 0) {
+			return err;
+		}
+	}
+
+	// No mapping, or the ring is empty and the driver sleeps until the
+	// producer pushes a value
+	do {
+		err = read(dev->fd, values, n * sizeof(int));
+	} while (err < 0 && errno == EINTR);
+
+	return err < 0 ? -1 : err / (ssize_t)sizeof(int);
+}
@@ -0,0 +1,77 @@
+/**
+* @file libflifo.h
+* @brief User space library of the flifo device. It moves whole batches
+*        of values per call, and goes through the mapped ring instead of
+*        the syscalls whenever the handle is the only producer or the only
+*        consumer of a list in FIFO mode.
+*/
+#ifndef LIBFLIFO_H
+#define LIBFLIFO_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include "flifo.h"
+
+// The handle is the only producer or the only consumer of the list, which
+// lets the library use the mapped ring (see struct flifo_ring)
+#define FLIFO_OPT_SPSC (1 << 0)
+
+struct flifo_dev;
+
+/**
+ * @brief Open a flifo device.
+ * @param path Path of the device, for instance "/dev/flifo0".
+ * @param flags Flags of open(2), O_RDWR and optionally O_NONBLOCK.
+ * @param options FLIFO_OPT_* options.
+ * @return The handle, or NULL on failure (errno is set).
+*/
+struct flifo_dev *flifo_open(const char *path, int flags,
+			     unsigned int options);
+
+/**
+ * @brief Close a handle opened with flifo_open.
+ * @param dev Handle to close, may be NULL.
+*/
+void flifo_close(struct flifo_dev *dev);
+
+/**
+ * @brief File descriptor of the device, for poll(2) or the ioctls the
+ *        library doesn't wrap.
+*/
+int flifo_fd(const struct flifo_dev *dev);
+
+/**
+ * @brief Whether the handle currently goes through the mapped ring.
+*/
+int flifo_is_mapped(const struct flifo_dev *dev);
+
+/**
+ * @brief Change the mode of the list (MODE_*). The ring is unmapped for
+ *        the other modes and mapped again when back in MODE_FIFO.
+ * @return 0 on success, -1 otherwise (errno is set).
+*/
+int flifo_set_mode(struct flifo_dev *dev, int mode);
+
+/**
+ * @brief Drop all the values of the list.
+ * @return 0 on success, -1 otherwise (errno is set).
+*/
+int flifo_reset(struct flifo_dev *dev);
+
+/**
+ * @brief Push n values into the list. A blocking handle waits until all of
+ *        them are pushed, a non-blocking one only pushes what fits.
+ * @return Number of values pushed, or -1 if none could be (errno is set,
+ *         ENOSPC if the list is full).
+*/
+ssize_t flifo_push_n(struct flifo_dev *dev, const int *values, size_t n);
+
+/**
+ * @brief Pop up to n values from the list. A blocking handle waits until
+ *        there is at least one.
+ * @return Number of values popped, or -1 if none could be (errno is set,
+ *         EAGAIN if the list is empty).
+*/
+ssize_t flifo_pop_n(struct flifo_dev *dev, int *values, size_t n);
+
+#endif /* LIBFLIFO_H */
@@ -13,52 +13,237 @@
 #include <linux/uaccess.h>
 #include <linux/cdev.h>
 #include <linux/device.h>
+#include <linux/mm.h>
+#include <linux/xarray.h>
+#include <linux/moduleparam.h>
+#include <linux/rwsem.h>
+#include <linux/uio.h>
+#include <linux/pagemap.h>
 
 #include <linux/string.h>
 
 #define MAJOR_NUM   98
 #define MAJMIN	    MKDEV(MAJOR_NUM, 0)
 #define DEVICE_NAME "parrot"
+// Each open of this minor gets its own buffer
+#define MAJMIN_PRIVATE MKDEV(MAJOR_NUM, 1)
+#define PRIVATE_NAME   "parrot_private"
+#define NB_MINORS      2
 
 static struct cdev cdev;
 static struct class *cl;
 
-uint8_t *device_buffer;
-size_t device_buffer_size = 8;
+/**
+ * struct parrot_buffer - Buffer of the device
+ * @pages:         Pages of the buffer, indexed by their offset in the
+ *                 buffer. They are only allocated once written, the missing
+ *                 ones read as zeros.
+ * @size:          Size of the buffer in bytes.
+ * @lock:          Shared by the readers, taken exclusively by the writers.
+ *                 The page faults don't take it, see parrot_fault.
+ * @truncate_lock: Shared by the page faults, taken exclusively with @lock
+ *                 to truncate the buffer. The read and write calls don't
+ *                 take it.
+ */
+struct parrot_buffer {
+	struct xarray pages;
+	size_t size;
+	struct rw_semaphore lock;
+	struct rw_semaphore truncate_lock;
+};
+
+static struct parrot_buffer shared_buffer = {
+	.pages = XARRAY_INIT(shared_buffer.pages, 0),
+	.size = 8,
+	.lock = __RWSEM_INITIALIZER(shared_buffer.lock),
+	.truncate_lock = __RWSEM_INITIALIZER(shared_buffer.truncate_lock),
+};
+
+static unsigned long max_size = 32 << 20;
+module_param(max_size, ulong, 0444);
+MODULE_PARM_DESC(max_size, "Maximum size of the buffer in bytes");
+
+/**
+ * @brief Get the page of the buffer at the given index, allocating a zeroed
+ *        one if it was never written.
+ *
+ * @param b buffer of the device
+ * @param index index of the page in the buffer
+ *
+ * @return The page, or NULL if it could not be allocated
+ */
+static struct page *parrot_get_page(struct parrot_buffer *b, pgoff_t index)
+{
+	struct page *page = xa_load(&b->pages, index);
+	struct page *old;
+
+	if (page) {
+		return page;
+	}
+
+	page = alloc_page(GFP_KERNEL | __GFP_ZERO);
+	if (!page) {
+		return NULL;
+	}
+
+	// A page fault may have allocated it in the meantime
+	old = xa_cmpxchg(&b->pages, index, NULL, page, GFP_KERNEL);
+	if (old) {
+		__free_page(page);
+		return xa_is_err(old) ? NULL : old;
+	}
+
+	return page;
+}
+
+/**
+ * @brief Free all the pages of the buffer, leaving it empty. The caller
+ *        holds the lock of the buffer for writing, and its truncate_lock if
+ *        the buffer may be mapped.
+ *
+ * @param b buffer of the device
+ */
+static void parrot_free_pages(struct parrot_buffer *b)
+{
+	struct page *page;
+	unsigned long index;
+
+	// The page lock waits for a fault that is still mapping the page, see
+	// parrot_fault. The pages still mapped in user space are freed once
+	// unmapped.
+	xa_for_each(&b->pages, index, page) {
+		lock_page(page);
+		xa_erase(&b->pages, index);
+		unlock_page(page);
+		put_page(page);
+	}
+}
+
+/**
+ * @brief Attach a buffer to the file: the shared one, or a new empty one
+ *        for /dev/parrot_private. Empty the shared buffer when the file is
+ *        opened with O_TRUNC, like a regular file.
+ *
+ * @param inode inode of the device
+ * @param filp pointer to the file descriptor being opened
+ *
+ * @return 0, or a negative error code
+ */
+static int parrot_open(struct inode *inode, struct file *filp)
+{
+	struct parrot_buffer *b = &shared_buffer;
+
+	if (iminor(inode) == MINOR(MAJMIN_PRIVATE)) {
+		b = kzalloc(sizeof(*b), GFP_KERNEL);
+		if (!b) {
+			return -ENOMEM;
+		}
+		xa_init(&b->pages);
+		init_rwsem(&b->lock);
+		init_rwsem(&b->truncate_lock);
+	}
+
+	filp->private_data = b;
+
+	// A new private buffer is already empty, and the mappings of the
+	// inode belong to every buffer
+	if (b == &shared_buffer && (filp->f_flags & O_TRUNC) &&
+	    (filp->f_mode & FMODE_WRITE)) {
+		// A read or write call may fault into a mapping of the buffer
+		// with the lock held, which is why it is taken first
+		down_write(&b->lock);
+		down_write(&b->truncate_lock);
+		// Like a truncated file, the mappings fault again and get
+		// SIGBUS past the new size. Once the pages are freed, the faults
+		// that saw the old size have mapped them.
+		WRITE_ONCE(b->size, 0);
+		parrot_free_pages(b);
+		unmap_mapping_range(inode->i_mapping, 0, 0, 1);
+		up_write(&b->truncate_lock);
+		up_write(&b->lock);
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Free the buffer of the file if it is a private one.
+ *
+ * @param inode inode of the device
+ * @param filp pointer to the file descriptor being released
+ *
+ * @return 0
+ */
+static int parrot_release(struct inode *inode, struct file *filp)
+{
+	struct parrot_buffer *b = filp->private_data;
+
+	// The mappings hold the file, no one else can use the buffer now
+	if (b != &shared_buffer) {
+		parrot_free_pages(b);
+		kfree(b);
+	}
+
+	return 0;
+}
 
 /**
  * @brief Read back previously written data in the internal buffer.
  *
- * @param filp pointer to the file descriptor in use
- * @param buf destination buffer in user space
- * @param count maximum number of data to read
- * @param ppos current position in file from which data will be read
- *              will be updated to new location
+ * @param iocb I/O control block, whose ki_pos is the current position in
+ *             file from which data will be read, updated to new location
+ * @param to destination segments, of as many bytes as there are data to
+ *           read at most
  *
  * @return Actual number of bytes read from internal buffer,
  *         or a negative error code
  */
-static ssize_t parrot_read(struct file *filp, char __user *buf, size_t count,
-			   loff_t *ppos)
+static ssize_t parrot_read_iter(struct kiocb *iocb, struct iov_iter *to)
 {
-	size_t available_bytes = device_buffer_size - *ppos;
-	size_t read_bytes = min(count, available_bytes);
+	struct parrot_buffer *b = iocb->ki_filp->private_data;
+	size_t read_bytes = 0;
+	size_t count;
+
+	// Readers don't block each other
+	if (down_read_killable(&b->lock)) {
+		return -EINTR;
+	}
 
 	// check if the current position is at the end of the buffer
-	if (*ppos >= device_buffer_size) {
+	if (iocb->ki_pos >= b->size) {
+		up_read(&b->lock);
 		return 0;
 	}
+	count = min_t(size_t, iov_iter_count(to), b->size - iocb->ki_pos);
 
-	if (!available_bytes) {
-		return 0;
+	// Copy data from kernel space to the segments, one page at a time
+	while (read_bytes < count) {
+		loff_t pos = iocb->ki_pos + read_bytes;
+		size_t offset = pos & ~PAGE_MASK;
+		size_t chunk = min_t(size_t, count - read_bytes,
+				     PAGE_SIZE - offset);
+		struct page *page = xa_load(&b->pages, pos >> PAGE_SHIFT);
+		size_t copied;
+
+		if (page) {
+			copied = copy_page_to_iter(page, offset, chunk, to);
+		} else {
+			copied = iov_iter_zero(chunk, to);
+		}
+
+		read_bytes += copied;
+		if (copied < chunk) {
+			break;
+		}
 	}
 
-	// Copy data from kernel space to user space
-	if (copy_to_user(buf, device_buffer + *ppos, read_bytes) != 0) {
+	up_read(&b->lock);
+
+	if (read_bytes == 0 && count > 0) {
 		return -EFAULT;
 	}
 
-	*ppos += read_bytes;
+	iocb->ki_pos += read_bytes;
 
 	return read_bytes;
 }
@@ -66,44 +251,192 @@ static ssize_t parrot_read(struct file *filp, char __user *buf, size_t count,
 /**
  * @brief Write data to the internal buffer
  *
- * @param filp pointer to the file descriptor in use
- * @param buf source buffer in user space
- * @param count number of data to write in the buffer
- * @param ppos current position in file to which data will be written
- *              will be updated to new location
+ * @param iocb I/O control block, whose ki_pos is the current position in
+ *             file to which data will be written, updated to new location
+ * @param from source segments, with the data to write in the buffer
  *
  * @return Actual number of bytes writen to internal buffer,
  *         or a negative error code
  */
-static ssize_t parrot_write(struct file *filp, const char __user *buf,
-			    size_t count, loff_t *ppos)
+static ssize_t parrot_write_iter(struct kiocb *iocb, struct iov_iter *from)
 {
-	size_t new_size = *ppos + count;
-	//Check if the new size is greater than 1024
-	if (new_size > 1024) {
+	struct parrot_buffer *b = iocb->ki_filp->private_data;
+	size_t count = iov_iter_count(from);
+	size_t written_bytes = 0;
+	ssize_t err = 0;
+
+	//Check if the new size is greater than the maximum
+	if (iocb->ki_pos + count > max_size) {
 		return -EFBIG;
 	}
 
-	// Check if the current position is at the end of the buffer
-	if (new_size > device_buffer_size) {
-		uint8_t *new_buffer =
-			krealloc(device_buffer, new_size, GFP_KERNEL);
-		if (!new_buffer) {
-			return -ENOMEM;
+	// Writers are serialised, and exclude the readers
+	if (down_write_killable(&b->lock)) {
+		return -EINTR;
+	}
+
+	// Copy data from the segments to kernel space, allocating the pages
+	// written for the first time
+	while (written_bytes < count) {
+		loff_t pos = iocb->ki_pos + written_bytes;
+		size_t offset = pos & ~PAGE_MASK;
+		size_t chunk = min_t(size_t, count - written_bytes,
+				     PAGE_SIZE - offset);
+		struct page *page = parrot_get_page(b, pos >> PAGE_SHIFT);
+		size_t copied;
+
+		if (!page) {
+			err = -ENOMEM;
+			break;
+		}
+
+		copied = copy_page_from_iter(page, offset, chunk, from);
+		written_bytes += copied;
+		if (copied < chunk) {
+			err = -EFAULT;
+			break;
 		}
-		device_buffer = new_buffer;
-		device_buffer_size = new_size;
 	}
 
-	// Copy data from user space to kernel space
-	if (copy_from_user(device_buffer + *ppos, buf, count)) {
-		return -EFAULT;
+	// Update the position, and the size if the buffer grew
+	iocb->ki_pos += written_bytes;
+	if (iocb->ki_pos > b->size) {
+		WRITE_ONCE(b->size, iocb->ki_pos);
+	}
+
+	up_write(&b->lock);
+
+	if (written_bytes == 0) {
+		return err;
+	}
+
+	return written_bytes;
+}
+
+/**
+ * @brief Change the position in the file. SEEK_DATA and SEEK_HOLE skip
+ *        to the next page written and never written respectively, the
+ *        end of the buffer counting as a hole.
+ *
+ * @param filp pointer to the file descriptor in use
+ * @param offset offset relative to whence
+ * @param whence SEEK_SET, SEEK_CUR, SEEK_END, SEEK_DATA or SEEK_HOLE
+ *
+ * @return The new position, or a negative error code
+ */
+static loff_t parrot_llseek(struct file *filp, loff_t offset, int whence)
+{
+	struct parrot_buffer *b = filp->private_data;
+	unsigned long index;
+	loff_t page_pos;
+
+	if (whence != SEEK_DATA && whence != SEEK_HOLE) {
+		return default_llseek(filp, offset, whence);
+	}
+
+	down_read(&b->lock);
+
+	if (offset < 0 || offset >= b->size) {
+		up_read(&b->lock);
+		return -ENXIO;
+	}
+
+	index = offset >> PAGE_SHIFT;
+	if (whence == SEEK_DATA) {
+		if (!xa_find(&b->pages, &index, ULONG_MAX, XA_PRESENT)) {
+			up_read(&b->lock);
+			return -ENXIO;
+		}
+	} else {
+		while (xa_load(&b->pages, index)) {
+			index++;
+		}
+	}
+
+	page_pos = (loff_t)index << PAGE_SHIFT;
+	offset = max(offset, page_pos);
+	if (offset >= b->size) {
+		offset = whence == SEEK_DATA ? -ENXIO : b->size;
+	}
+
+	up_read(&b->lock);
+
+	if (offset < 0) {
+		return offset;
+	}
+
+	return vfs_setpos(filp, offset, max_size);
+}
+
+/**
+ * @brief Page fault of a mapping of the buffer, maps the page of the buffer
+ *        itself so that the mapping sees the read and write calls and the
+ *        other way around.
+ *
+ * @param vmf description of the fault
+ *
+ * @return VM_FAULT_LOCKED with vmf->page set and locked, or a VM_FAULT_*
+ *         error
+ */
+static vm_fault_t parrot_fault(struct vm_fault *vmf)
+{
+	struct parrot_buffer *b = vmf->vma->vm_file->private_data;
+	struct page *page;
+
+	// The lock of the buffer isn't taken, a read or write call into a
+	// mapping of the buffer would fault with it held. The truncate_lock
+	// keeps the size and the pages until the page is pinned.
+	down_read(&b->truncate_lock);
+
+	// Like a regular file, a mapping can't go past the end of the buffer
+	if (vmf->pgoff >= DIV_ROUND_UP(READ_ONCE(b->size), PAGE_SIZE)) {
+		up_read(&b->truncate_lock);
+		return VM_FAULT_SIGBUS;
+	}
+
+	page = parrot_get_page(b, vmf->pgoff);
+	if (!page) {
+		up_read(&b->truncate_lock);
+		return VM_FAULT_OOM;
+	}
+
+	// Dropped when the page is unmapped
+	get_page(page);
+	// Held until the page is mapped, a truncation waits for it before
+	// unmapping the buffer
+	lock_page(page);
+
+	up_read(&b->truncate_lock);
+
+	vmf->page = page;
+
+	return VM_FAULT_LOCKED;
+}
+
+static const struct vm_operations_struct parrot_vm_ops = {
+	.fault = parrot_fault,
+};
+
+/**
+ * @brief Map the buffer in user space. The pages are mapped on first access
+ *        by parrot_fault.
+ *
+ * @param filp pointer to the file descriptor in use
+ * @param vma area to map the buffer in
+ *
+ * @return 0, or a negative error code
+ */
+static int parrot_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	unsigned long max_pages = DIV_ROUND_UP(max_size, PAGE_SIZE);
+
+	if (vma->vm_pgoff + vma_pages(vma) > max_pages) {
+		return -EINVAL;
 	}
 
-	// Update the position
-	*ppos += count;
+	vma->vm_ops = &parrot_vm_ops;
 
-	return count;
+	return 0;
 }
 
 /**
@@ -121,51 +454,59 @@ static int parrot_uevent(struct device *dev, struct kobj_uevent_env *env)
 
 static const struct file_operations parrot_fops = {
 	.owner = THIS_MODULE,
-	.read = parrot_read,
-	.write = parrot_write,
-	.llseek = default_llseek, // Use default to enable seeking to 0
+	.open = parrot_open,
+	.release = parrot_release,
+	.read_iter = parrot_read_iter,
+	.write_iter = parrot_write_iter,
+	.mmap = parrot_mmap,
+	.llseek = parrot_llseek,
 };
 
 static int __init parrot_init(void)
 {
+	struct device *dev;
 	int err;
 
-	device_buffer = kzalloc(8, GFP_KERNEL);
-
-	if (device_buffer == NULL) {
-		pr_err("Parrot: Error allocating memory\n");
-		return -ENOMEM;
-	}
-
 	// Register the device
-	err = register_chrdev_region(MAJMIN, 1, DEVICE_NAME);
+	err = register_chrdev_region(MAJMIN, NB_MINORS, DEVICE_NAME);
 	if (err != 0) {
 		pr_err("Parrot: Registering char device failed\n");
 		return err;
 	}
 
 	cl = class_create(THIS_MODULE, DEVICE_NAME);
-	if (cl == NULL) {
+	if (IS_ERR(cl)) {
 		pr_err("Parrot: Error creating class\n");
-		unregister_chrdev_region(MAJMIN, 1);
-		return -1;
+		unregister_chrdev_region(MAJMIN, NB_MINORS);
+		return PTR_ERR(cl);
 	}
 	cl->dev_uevent = parrot_uevent;
 
-	if (device_create(cl, NULL, MAJMIN, NULL, DEVICE_NAME) == NULL) {
+	dev = device_create(cl, NULL, MAJMIN, NULL, DEVICE_NAME);
+	if (IS_ERR(dev)) {
 		pr_err("Parrot: Error creating device\n");
 		class_destroy(cl);
-		unregister_chrdev_region(MAJMIN, 1);
-		return -1;
+		unregister_chrdev_region(MAJMIN, NB_MINORS);
+		return PTR_ERR(dev);
+	}
+
+	dev = device_create(cl, NULL, MAJMIN_PRIVATE, NULL, PRIVATE_NAME);
+	if (IS_ERR(dev)) {
+		pr_err("Parrot: Error creating private device\n");
+		device_destroy(cl, MAJMIN);
+		class_destroy(cl);
+		unregister_chrdev_region(MAJMIN, NB_MINORS);
+		return PTR_ERR(dev);
 	}
 
 	cdev_init(&cdev, &parrot_fops);
-	err = cdev_add(&cdev, MAJMIN, 1);
+	err = cdev_add(&cdev, MAJMIN, NB_MINORS);
 	if (err < 0) {
 		pr_err("Parrot: Adding char device failed\n");
+		device_destroy(cl, MAJMIN_PRIVATE);
 		device_destroy(cl, MAJMIN);
 		class_destroy(cl);
-		unregister_chrdev_region(MAJMIN, 1);
+		unregister_chrdev_region(MAJMIN, NB_MINORS);
 		return err;
 	}
 
@@ -177,14 +518,15 @@ static void __exit parrot_exit(void)
 {
 	// Unregister the device
 	cdev_del(&cdev);
+	device_destroy(cl, MAJMIN_PRIVATE);
 	device_destroy(cl, MAJMIN);
 	class_destroy(cl);
-	unregister_chrdev_region(MAJMIN, 1);
+	unregister_chrdev_region(MAJMIN, NB_MINORS);
 
 	pr_info("Parrot done!\n");
 
 	// Free the allocated memory
-	kfree(device_buffer);
+	parrot_free_pages(&shared_buffer);
 }
 
 MODULE_AUTHOR("REDS");
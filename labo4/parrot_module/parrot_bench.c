@@ -0,0 +1,219 @@
+/**
+ * @file parrot_bench.c
+ * @brief Write throughput of the parrot device versus the size of the
+ *        buffer. The buffer is emptied then filled by appending CHUNK bytes
+ *        at a time, for sizes from MIN_SIZE to MAX_SIZE. With page-backed
+ *        storage, the throughput should not depend on the size.
+ *        The read throughput is then measured for 1 to the number of CPUs
+ *        reader threads, which should scale as the readers don't block
+ *        each other. Last, records split in fragments are written with
+ *        one write per fragment and with a single writev.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#define DEVICE_PATH "/dev/parrot"
+
+#define CHUNK	    4096
+#define MIN_SIZE    (64 << 10)
+#define MAX_SIZE    (16 << 20)
+
+// Each reader reads the whole buffer READ_ROUNDS times
+#define READ_SIZE   (1 << 20)
+#define READ_CHUNK  (64 << 10)
+#define READ_ROUNDS 64
+#define MAX_READERS 16
+
+// Records of NB_FRAGMENTS fragments of FRAGMENT_SIZE bytes
+#define NB_RECORDS    (1 << 14)
+#define NB_FRAGMENTS  16
+#define FRAGMENT_SIZE 64
+
+/**
+ * @brief Append size bytes to the emptied buffer.
+ *
+ * @return The throughput in MB/s
+ */
+static double write_throughput(size_t size)
+{
+	static char chunk[CHUNK];
+	struct timespec start, end;
+	double elapsed;
+	size_t i;
+	int fd;
+
+	fd = open(DEVICE_PATH, O_WRONLY | O_TRUNC);
+	if (fd < 0) {
+		perror("parrot_bench");
+		exit(EXIT_FAILURE);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < size; i += CHUNK) {
+		if (write(fd, chunk, CHUNK) != CHUNK) {
+			perror("write");
+			exit(EXIT_FAILURE);
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	close(fd);
+
+	elapsed = (end.tv_sec - start.tv_sec) +
+		  (end.tv_nsec - start.tv_nsec) / 1e9;
+	return size / elapsed / 1e6;
+}
+
+/**
+ * @brief Reader thread, reads the buffer READ_ROUNDS times.
+ *
+ * @param arg unused
+ */
+static void *reader(void *arg)
+{
+	static __thread char chunk[READ_CHUNK];
+	off_t pos;
+	int fd;
+	int i;
+
+	(void)arg;
+	fd = open(DEVICE_PATH, O_RDONLY);
+	if (fd < 0) {
+		perror("parrot_bench");
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < READ_ROUNDS; i++) {
+		for (pos = 0; pos < READ_SIZE; pos += READ_CHUNK) {
+			if (pread(fd, chunk, READ_CHUNK, pos) != READ_CHUNK) {
+				perror("pread");
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+
+	close(fd);
+	return NULL;
+}
+
+/**
+ * @brief Run nb_readers reader threads on the buffer in parallel.
+ *
+ * @return The total throughput in MB/s
+ */
+static double read_throughput(int nb_readers)
+{
+	pthread_t threads[MAX_READERS];
+	struct timespec start, end;
+	double elapsed;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < nb_readers; i++) {
+		pthread_create(&threads[i], NULL, reader, NULL);
+	}
+	for (i = 0; i < nb_readers; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	elapsed = (end.tv_sec - start.tv_sec) +
+		  (end.tv_nsec - start.tv_nsec) / 1e9;
+	return (double)nb_readers * READ_ROUNDS * READ_SIZE / elapsed / 1e6;
+}
+
+/**
+ * @brief Write NB_RECORDS records to the emptied buffer.
+ *
+ * @param use_writev whether to write each record with a single writev,
+ *                   instead of one write per fragment
+ *
+ * @return The number of records written per second
+ */
+static double record_throughput(int use_writev)
+{
+	static char fragments[NB_FRAGMENTS][FRAGMENT_SIZE];
+	struct iovec iov[NB_FRAGMENTS];
+	struct timespec start, end;
+	double elapsed;
+	int fd;
+	int i;
+	int j;
+
+	for (j = 0; j < NB_FRAGMENTS; j++) {
+		iov[j].iov_base = fragments[j];
+		iov[j].iov_len = FRAGMENT_SIZE;
+	}
+
+	fd = open(DEVICE_PATH, O_WRONLY | O_TRUNC);
+	if (fd < 0) {
+		perror("parrot_bench");
+		exit(EXIT_FAILURE);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < NB_RECORDS; i++) {
+		if (use_writev) {
+			if (writev(fd, iov, NB_FRAGMENTS) !=
+			    NB_FRAGMENTS * FRAGMENT_SIZE) {
+				perror("writev");
+				exit(EXIT_FAILURE);
+			}
+			continue;
+		}
+
+		for (j = 0; j < NB_FRAGMENTS; j++) {
+			if (write(fd, fragments[j], FRAGMENT_SIZE) !=
+			    FRAGMENT_SIZE) {
+				perror("write");
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	close(fd);
+
+	elapsed = (end.tv_sec - start.tv_sec) +
+		  (end.tv_nsec - start.tv_nsec) / 1e9;
+	return NB_RECORDS / elapsed;
+}
+
+int main(void)
+{
+	long max_readers = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t size;
+	int fd;
+	int i;
+
+	for (size = MIN_SIZE; size <= MAX_SIZE; size *= 4) {
+		printf("%6zu KiB: %8.1f MB/s\n", size >> 10,
+		       write_throughput(size));
+	}
+
+	// Readers in parallel on a buffer of READ_SIZE bytes
+	if (max_readers < 1 || max_readers > MAX_READERS) {
+		max_readers = MAX_READERS;
+	}
+	write_throughput(READ_SIZE);
+	for (i = 1; i <= max_readers; i++) {
+		printf("%2d reader(s): %8.1f MB/s\n", i, read_throughput(i));
+	}
+
+	// Records of several fragments
+	printf("One write per fragment: %10.0f records/s\n",
+	       record_throughput(0));
+	printf("Single writev:          %10.0f records/s\n",
+	       record_throughput(1));
+
+	// Give the memory back
+	fd = open(DEVICE_PATH, O_WRONLY | O_TRUNC);
+	if (fd >= 0) {
+		close(fd);
+	}
+
+	return EXIT_SUCCESS;
+}
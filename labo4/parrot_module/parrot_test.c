@@ -1,11 +1,20 @@
+#define _GNU_SOURCE /* Needed for SEEK_DATA and SEEK_HOLE */
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 
 #define NB_DATA 128
 
+// Offset of the byte written far past the data, leaving a hole
+#define SPARSE_OFFSET (1 << 20)
+// Offset of the data written with a single writev
+#define WRITEV_OFFSET (2 << 20)
+
 int main(void)
 {
 	int fd;
@@ -15,8 +24,14 @@ int main(void)
 	int success;
 	uint8_t datas[NB_DATA];
 	uint8_t datas_read[NB_DATA];
-
-	fd = open("/dev/parrot", O_RDWR);
+	uint8_t *map;
+	long page_size = sysconf(_SC_PAGESIZE);
+	struct iovec iov[NB_DATA];
+	int nb_fragments;
+	int private_fds[2];
+
+	// Start from an empty buffer
+	fd = open("/dev/parrot", O_RDWR | O_TRUNC);
 	if (fd < 0) {
 		perror("parrot_test");
 	}
@@ -92,5 +107,110 @@ int main(void)
 		printf("Some data are incorrect\n");
 	}
 
+	// Map the buffer, it must match the read and write calls
+	map = mmap(NULL, NB_DATA, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		return EXIT_FAILURE;
+	}
+
+	success = memcmp(map, datas, NB_DATA) == 0;
+
+	// Patch the buffer through the mapping and read it back
+	map[0] = 0xaa;
+	lseek(fd, 0, SEEK_SET);
+	success &= read(fd, datas_read, 1) == 1 && datas_read[0] == 0xaa;
+
+	// Write the buffer and look at it through the mapping
+	datas[1] = 0x55;
+	lseek(fd, 1, SEEK_SET);
+	success &= write(fd, &datas[1], 1) == 1 && map[1] == 0x55;
+
+	munmap(map, NB_DATA);
+	if (success) {
+		printf("The mapping matches the buffer\n");
+	} else {
+		printf("The mapping doesn't match the buffer\n");
+	}
+
+	// Write a byte far away, what is in between must be a hole
+	lseek(fd, SPARSE_OFFSET, SEEK_SET);
+	success = write(fd, datas, 1) == 1;
+
+	// The data written first fill part of the first page
+	success &= lseek(fd, 0, SEEK_HOLE) == page_size;
+	success &= lseek(fd, NB_DATA, SEEK_DATA) == NB_DATA;
+	success &= lseek(fd, page_size, SEEK_DATA) == SPARSE_OFFSET;
+	success &= lseek(fd, SPARSE_OFFSET, SEEK_HOLE) == SPARSE_OFFSET + 1;
+
+	// The hole reads as zeros
+	lseek(fd, SPARSE_OFFSET - NB_DATA, SEEK_SET);
+	success &= read(fd, datas_read, NB_DATA) == NB_DATA;
+	for (i = 0; i < NB_DATA; i++) {
+		success &= datas_read[i] == 0;
+	}
+
+	if (success) {
+		printf("Holes are skipped and read as zeros\n");
+	} else {
+		printf("Holes are not handled correctly\n");
+	}
+
+	// Write the data again, split in fragments of random sizes like above,
+	// but with a single call
+	nb_fragments = 0;
+	for (i = 0; i < NB_DATA; i += nb_to_write) {
+		nb_to_write = (rand() % 32) + 1;
+		if (i + nb_to_write > NB_DATA) {
+			nb_to_write = NB_DATA - i;
+		}
+
+		iov[nb_fragments].iov_base = &datas[i];
+		iov[nb_fragments].iov_len = nb_to_write;
+		nb_fragments++;
+	}
+
+	success = pwritev(fd, iov, nb_fragments, WRITEV_OFFSET) == NB_DATA;
+
+	// Read them back in two halves with a single call
+	iov[0].iov_base = datas_read;
+	iov[0].iov_len = NB_DATA / 2;
+	iov[1].iov_base = &datas_read[NB_DATA / 2];
+	iov[1].iov_len = NB_DATA / 2;
+	success &= preadv(fd, iov, 2, WRITEV_OFFSET) == NB_DATA;
+	success &= memcmp(datas, datas_read, NB_DATA) == 0;
+
+	if (success) {
+		printf("writev and readv move all the fragments\n");
+	} else {
+		printf("writev and readv don't move all the fragments\n");
+	}
+
+	// Each open of the private device has its own buffer, empty at first
+	private_fds[0] = open("/dev/parrot_private", O_RDWR);
+	private_fds[1] = open("/dev/parrot_private", O_RDWR);
+	if (private_fds[0] < 0 || private_fds[1] < 0) {
+		perror("parrot_test private");
+		return EXIT_FAILURE;
+	}
+
+	success = read(private_fds[0], datas_read, NB_DATA) == 0;
+	success &= write(private_fds[0], datas, NB_DATA) == NB_DATA;
+	success &= write(private_fds[1], &datas[1], 1) == 1;
+
+	// Neither sees the data of the other, nor of the shared buffer
+	success &= pread(private_fds[0], datas_read, NB_DATA, 0) == NB_DATA;
+	success &= memcmp(datas, datas_read, NB_DATA) == 0;
+	success &= pread(private_fds[1], datas_read, NB_DATA, 0) == 1;
+	success &= datas_read[0] == datas[1];
+
+	close(private_fds[0]);
+	close(private_fds[1]);
+	if (success) {
+		printf("Private buffers are independent\n");
+	} else {
+		printf("Private buffers are mixed up\n");
+	}
+
 	return EXIT_SUCCESS;
 }